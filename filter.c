@@ -16,13 +16,128 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include "filter.h"
+#include "filterJit.h"
+#include "fragTable.h"
+#include "ipBloom.h"
+#include "payloadScan.h"
 #include "pktUtility.h"
+#include "statCount.h"
 
 /// maximum line length of a configuration file
 #define MAX_LINE_LEN  256
 
-/// The type used to hold the configuration settings for a filter
+/// fewest blocked addresses worth putting a Bloom filter in front of; below
+/// this the sorted array is only a few cache lines and is searched directly
+#define BLOOM_MIN_ADDRESSES 256
+
+/// most blocked addresses updates add or remove before they are merged into
+/// the sorted array; they are merged sooner once they are a 64th of it
+#define MAX_PENDING_ADDRESSES 1024
+
+/// number of random packets a compiled filter is checked against the
+/// interpreter with before it is used
+#define JIT_VERIFY_PACKETS 4096
+
+/// length of the IP header, which like pktUtility assumes has no options
+#define IP_HEADER_LEN 20
+
+/// length of a UDP header
+#define UDP_HEADER_LEN 8
+
+/// offset in the TCP header of the byte holding the data offset
+#define TCP_DATA_OFFSET 12
+
+/// most fragmented datagrams whose verdict is remembered at once
+#define FRAG_TABLE_ENTRIES 4096
+
+/// seconds a fragmented datagram is remembered, as long as Linux waits to
+/// reassemble one
+#define FRAG_TIMEOUT 30
+
+/// most blocked IP addresses compared one by one instead of binary searched
+#define MAX_SCANNED_ADDRESSES 8
+
+/// in adaptive mode, every rule is checked on one in this many packets
+#define RULE_SAMPLE_RATE 16
+
+/// number of bits used for one rule in a packed rule order
+#define RULE_BITS 4
+
+/// The checks filter_packet makes on a packet. Every one of them blocks the
+/// packet when it matches, so the first match and the verdict are the same
+/// whatever order they are checked in; only the work done differs.
+typedef enum FilterRule_E
+{
+    RULE_SRC_IP,                               ///< blocked source address
+    RULE_DST_IP,                               ///< blocked destination address
+    RULE_ECHO_REQ,                             ///< inbound ICMP echo request
+    RULE_TCP_PORT,                             ///< inbound blocked TCP port
+    NUM_RULES
+} FilterRule;
+
+/// the order filter_packet has always used, addresses then protocol checks
+#define DEFAULT_RULE_ORDER (RULE_SRC_IP | RULE_DST_IP << RULE_BITS | \
+                            RULE_ECHO_REQ << 2 * RULE_BITS | \
+                            RULE_TCP_PORT << 3 * RULE_BITS)
+
+/// names of the rules, for print_filter_stats
+static const char * const ruleNames[NUM_RULES] =
+    { "src-ip", "dst-ip", "echo-req", "tcp-port" };
+
+/// How the blocked IP addresses of a configuration are looked up, by how
+/// many of them there are
+typedef enum IpLookup_E
+{
+    IP_LOOKUP_NONE,                            ///< no address is blocked
+    IP_LOOKUP_SCAN,                            ///< compared one by one
+    IP_LOOKUP_SEARCH,                          ///< binary searched
+    IP_LOOKUP_BLOOM,                           ///< Bloom filter, then search
+    NUM_IP_LOOKUPS
+} IpLookup;
+
+/// names of the IP lookups, for print_filter_stats
+static const char * const ipLookupNames[NUM_IP_LOOKUPS] =
+    { "none", "scan", "binary search", "bloom filter" };
+
+/// The type used to count how well the Bloom filter in front of the blocked
+/// addresses is doing. Only the filter thread writes these.
+typedef struct BloomStats_S
+{
+    atomic_ulong queries;                      ///< addresses looked up
+    atomic_ulong maybeHits;                    ///< lookups the bloom passed
+    atomic_ulong hits;                         ///< lookups that were blocked
+} BloomStats;
+
+
+/// The payload patterns of a configuration file, compiled into a scanner.
+/// Configurations copied for an incremental update share it with the one
+/// they were copied from rather than compiling it again.
+typedef struct PayloadPatterns_S
+{
+    atomic_uint refs;                          ///< configurations using it
+    unsigned int numPatterns;                  ///< BLOCK_PAYLOAD settings
+    PayloadScanner scanner;                    ///< the compiled patterns
+} PayloadPatterns;
+
+
+/// The BLOCK_PAYLOAD patterns of a configuration file while it is read
+typedef struct PatternList_S
+{
+    unsigned int numPatterns;                  ///< patterns read so far
+    unsigned char** patterns;                  ///< the decoded patterns
+    unsigned int* lengths;                     ///< length of each pattern
+} PatternList;
+
+
+/// The type used to hold the configuration settings for a filter. Once a
+/// configuration has been published to a filter it is never modified again;
+/// updates build a new copy and publish that instead.
 typedef struct FilterConfig_S
 {
     unsigned int localIpAddr;                  ///< the local IP address
@@ -30,10 +145,74 @@ typedef struct FilterConfig_S
     bool blockInboundEchoReq;                  ///< where to block inbound echo
     unsigned int numBlockedInboundTcpPorts;    ///< count of blocked ports
     unsigned int* blockedInboundTcpPorts;      ///< array of blocked ports
-    unsigned int numBlockedIpAddresses;        ///< count of blocked addresses
-    unsigned int* blockedIpAddresses;          ///< array of blocked addresses
+    unsigned int numBlockedIpAddresses;        ///< count of merged addresses
+    unsigned int* blockedIpAddresses;          ///< sorted merged addresses
+    IpBloom ipBloom;                           ///< prefilter or NULL if small
+    atomic_uint* ipRefs;                       ///< configurations sharing the
+                                               ///< three above, NULL if one
+    unsigned int numAddedIpAddresses;          ///< count of added addresses
+    unsigned int* addedIpAddresses;            ///< sorted, blocked since merge
+    unsigned int numRemovedIpAddresses;        ///< count of removed addresses
+    unsigned int* removedIpAddresses;          ///< sorted, unblocked since merge
+    BloomStats* bloomStats;                    ///< where bloom use is counted
+    bool noIpBloom;                            ///< never build ipBloom, to
+                                               ///< measure what it saves
+    bool adaptiveRuleOrder;                    ///< reorder rules by hit rate
+    bool jitCompile;                           ///< compile to native code
+    bool genericCheck;                         ///< skip the variants, to
+                                               ///< measure what they save
+    FilterJit jit;                             ///< the native code, or NULL
+    JitFilterFn jitFn;                         ///< entry point of jit
+    PayloadPatterns* payloads;                 ///< shared, NULL if none
+    IpLookup ipLookup;                         ///< how checkFn finds addresses
+    /// the version of check_packet built for these rules
+    bool (*checkFn)(struct FilterConfig_S*, unsigned char*);
 } FilterConfig;
 
+/// The type of a version of check_packet built for one set of rules
+typedef bool (*CheckFn)(FilterConfig* fltCfg, unsigned char* pkt);
+
+
+/// The type used to keep the hit statistics of one rule in adaptive mode
+typedef struct RuleStats_S
+{
+    atomic_ulong hits;                         ///< sampled packets it matched
+    unsigned long lastHits;                    ///< hits at the last reorder
+    double score;                              ///< smoothed hit rate per cost
+} RuleStats;
+
+
+/// The information about a packet that the rules share. The inbound check
+/// is only worked out if a rule needs it.
+typedef struct PacketInfo_S
+{
+    unsigned char* pkt;                        ///< the packet itself
+    unsigned int srcIpAddr;                    ///< source address
+    unsigned int dstIpAddr;                    ///< destination address
+    int inbound;                               ///< 1 or 0, -1 until worked out
+} PacketInfo;
+
+
+/// The type behind an IpPktFilter. Holds the configuration currently in use
+/// and the bookkeeping needed to replace it while packets are being filtered.
+typedef struct Filter_S
+{
+    _Atomic(FilterConfig*) active;             ///< configuration in use
+    atomic_uint readerSeq;                     ///< odd while filtering a packet
+    pthread_mutex_t updateLock;                ///< serializes updates
+    atomic_uint ruleOrder;                     ///< packed adaptive rule order
+    unsigned int sampleCount;                  ///< packets since last sample
+    atomic_ulong numSampled;                   ///< packets sampled in total
+    unsigned long lastSampled;                 ///< numSampled at last reorder
+    RuleStats ruleStats[NUM_RULES];            ///< per rule hit statistics
+    BloomStats bloomStats;                     ///< Bloom filter statistics
+    atomic_ulong payloadsScanned;              ///< payloads searched
+    atomic_ulong payloadsBlocked;              ///< payloads with a pattern
+    atomic_ulong payloadsMalformed;            ///< TCP headers of bad length
+    atomic_ulong truncated;                    ///< packets cut short
+    FragTable frags;                           ///< verdicts on first fragments
+} Filter;
+
 
 /// Parses the remainder of the string last operated on by strtok
 /// and converts each octet of the ASCII string IP address to an
@@ -56,20 +235,117 @@ static void parse_remainder_of_string_for_ip(unsigned int* ipAddr)
 }
 
 
+/// Finds where a value is, or would go, in a sorted array using a binary
+/// search.
+/// @param values The sorted array
+/// @param numValues The number of values in the array
+/// @param value The value to look for
+/// @return The index of the first value that is not less than value
+static unsigned int find_sorted_value(const unsigned int* values,
+                                      unsigned int numValues, unsigned int value)
+{
+    unsigned int low = 0, high = numValues;
+
+    while(low < high)
+    {
+        unsigned int mid = low + (high - low) / 2;
+        if(values[mid] < value)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
+/// Checks if a value is in a sorted array.
+/// @param values The sorted array
+/// @param numValues The number of values in the array
+/// @param value The value to look for
+/// @return True if the value is listed
+static bool sorted_value_listed(const unsigned int* values, unsigned int numValues,
+                                unsigned int value)
+{
+    unsigned int i = find_sorted_value(values, numValues, value);
+    return i < numValues && values[i] == value;
+}
+
+
+/// Checks if an IP address was blocked by an update since the blocked
+/// addresses were last merged.
+/// @param fltCfg The filter configuration to use
+/// @param addr The IP address that is to be checked
+/// @return True if the IP address was added
+static bool ip_address_added(FilterConfig* fltCfg, unsigned int addr)
+{
+    return fltCfg->numAddedIpAddresses > 0 &&
+           sorted_value_listed(fltCfg->addedIpAddresses,
+                               fltCfg->numAddedIpAddresses, addr);
+}
+
+
+/// Checks if an IP address is among the merged blocked addresses and was not
+/// unblocked by an update since.
+/// @param fltCfg The filter configuration to use
+/// @param addr The IP address that is to be checked
+/// @return True if the IP address is listed
+static bool ip_address_merged(FilterConfig* fltCfg, unsigned int addr)
+{
+    return sorted_value_listed(fltCfg->blockedIpAddresses,
+                               fltCfg->numBlockedIpAddresses, addr) &&
+           (fltCfg->numRemovedIpAddresses == 0 ||
+            !sorted_value_listed(fltCfg->removedIpAddresses,
+                                 fltCfg->numRemovedIpAddresses, addr));
+}
+
+
+/// Checks if an IP address is blocked by searching the sorted arrays.
+/// @param fltCfg The filter configuration to use
+/// @param addr The IP address that is to be checked
+/// @return True if the IP address is listed
+static bool ip_address_listed(FilterConfig* fltCfg, unsigned int addr)
+{
+    return ip_address_added(fltCfg, addr) || ip_address_merged(fltCfg, addr);
+}
+
+
+/// Counts the IP addresses a configuration blocks.
+/// @param fltCfg The filter configuration
+/// @return The merged addresses and those added since, less those removed
+static unsigned int count_blocked_ip_addresses(const FilterConfig* fltCfg)
+{
+    return fltCfg->numBlockedIpAddresses + fltCfg->numAddedIpAddresses -
+           fltCfg->numRemovedIpAddresses;
+}
+
+
 /// Checks if an IP address is listed as blocked by the supplied filter.
+/// When the list is large, the Bloom filter gets the first look and the
+/// sorted array is only searched if the Bloom filter cannot rule it out.
+/// Addresses added since the Bloom filter was built are looked for first.
 /// @param fltCfg The filter configuration to use
 /// @param addr The IP address that is to be checked
 /// @return True if the IP address is to be blocked
 static bool block_ip_address(FilterConfig* fltCfg, unsigned int addr)
 {
-    for(unsigned int i = 0; i < fltCfg->numBlockedIpAddresses; ++i)
-    {
-        // if the IP Address is set to be blocked, we return tru to alert that
-        if(fltCfg->blockedIpAddresses[i] == addr)
-            return true;
-    }
-    // if we get here we're okay we can allow it through
-    return false;
+    bool blocked;
+
+    // small lists are searched directly
+    if(fltCfg->ipBloom == NULL)
+        return ip_address_listed(fltCfg, addr);
+    if(ip_address_added(fltCfg, addr))
+        return true;
+
+    add_count(&fltCfg->bloomStats->queries, 1);
+    if(!ip_bloom_may_contain(fltCfg->ipBloom, addr))
+        return false;
+
+    // the bloom can't rule it out, so check the real thing
+    add_count(&fltCfg->bloomStats->maybeHits, 1);
+    blocked = ip_address_merged(fltCfg, addr);
+    if(blocked)
+        add_count(&fltCfg->bloomStats->hits, 1);
+    return blocked;
 }
 
 
@@ -148,33 +424,408 @@ static void add_blocked_inbound_tcp_port(FilterConfig* fltCfg, unsigned int port
 }
 
 
-/// Creates an instance of a filter by allocating memory for a FilterConfig
-/// and initializing its member variables.
+/// Removes the specified value from an array of blocked values, keeping the
+/// rest of the array in order.
+/// @param values The array of blocked values
+/// @param numValues The number of entries in the array, updated on removal
+/// @param value The value that is no longer to be blocked
+/// @return True if the value was found and removed
+static bool remove_blocked_value(unsigned int* values, unsigned int* numValues,
+                                 unsigned int value)
+{
+    for(unsigned int i = 0; i < *numValues; ++i)
+    {
+        if(values[i] == value)
+        {
+            // shifts the entries after it down to fill the hole
+            --(*numValues);
+            memmove(&values[i], &values[i + 1],
+                    sizeof(unsigned int) * (*numValues - i));
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/// Installs the version of check_packet built for the rules a configuration
+/// has.
+static void select_check_variant(FilterConfig* fltCfg);
+
+
+/// Allocates a filter configuration and initializes it to block nothing.
+/// @return A pointer to the new configuration, NULL if malloc failed
+static FilterConfig* create_config(void)
+{
+    FilterConfig* fltCfg = malloc(sizeof(FilterConfig));
+
+    // checks to make sure malloc was successful
+    if(fltCfg == NULL)
+    {
+        perror("Error creating filter");
+        return NULL;
+    }
+
+    // if we get here malloc was successful; we can set defaults
+    fltCfg->localIpAddr = 0;
+    fltCfg->localMask = 0;
+    fltCfg->blockInboundEchoReq = false;
+    fltCfg->numBlockedInboundTcpPorts = 0;
+    fltCfg->blockedInboundTcpPorts = NULL;
+    fltCfg->numBlockedIpAddresses = 0;
+    fltCfg->blockedIpAddresses = NULL;
+    fltCfg->ipBloom = NULL;
+    fltCfg->ipRefs = NULL;
+    fltCfg->numAddedIpAddresses = 0;
+    fltCfg->addedIpAddresses = NULL;
+    fltCfg->numRemovedIpAddresses = 0;
+    fltCfg->removedIpAddresses = NULL;
+    fltCfg->bloomStats = NULL;
+    fltCfg->noIpBloom = false;
+    fltCfg->adaptiveRuleOrder = false;
+    fltCfg->jitCompile = false;
+    fltCfg->genericCheck = false;
+    fltCfg->jit = NULL;
+    fltCfg->jitFn = NULL;
+    fltCfg->payloads = NULL;
+    select_check_variant(fltCfg);
+
+    return fltCfg;
+}
+
+
+/// Lets go of the merged blocked addresses of a configuration and their
+/// Bloom filter, freeing them if no other configuration shares them.
+/// @param fltCfg The configuration
+static void release_blocked_ip_addresses(FilterConfig* fltCfg)
+{
+    if(fltCfg->ipRefs == NULL || atomic_fetch_sub(fltCfg->ipRefs, 1) == 1)
+    {
+        free(fltCfg->blockedIpAddresses);
+        if(fltCfg->ipBloom != NULL)
+            destroy_ip_bloom(fltCfg->ipBloom);
+        free(fltCfg->ipRefs);
+    }
+    fltCfg->numBlockedIpAddresses = 0;
+    fltCfg->blockedIpAddresses = NULL;
+    fltCfg->ipBloom = NULL;
+    fltCfg->ipRefs = NULL;
+}
+
+
+/// Frees a filter configuration and the arrays it owns.
+/// @param fltCfg The configuration to free, may be NULL
+static void destroy_config(FilterConfig* fltCfg)
+{
+    if(fltCfg == NULL)
+        return;
+    free(fltCfg->blockedInboundTcpPorts);
+    release_blocked_ip_addresses(fltCfg);
+    free(fltCfg->addedIpAddresses);
+    free(fltCfg->removedIpAddresses);
+    if(fltCfg->jit != NULL)
+        destroy_filter_jit(fltCfg->jit);
+    // the last configuration using the patterns frees them
+    if(fltCfg->payloads != NULL && atomic_fetch_sub(&fltCfg->payloads->refs, 1) == 1)
+    {
+        destroy_payload_scanner(fltCfg->payloads->scanner);
+        free(fltCfg->payloads);
+    }
+    free(fltCfg);
+}
+
+
+/// Makes a copy of a filter configuration so it can be modified without
+/// disturbing a reader of the original. The merged blocked addresses and
+/// their Bloom filter are shared, everything else is copied.
+/// @param fltCfg The configuration to copy, whose addresses are prepared
+/// @return A pointer to the copy, NULL if memory ran out
+static FilterConfig* copy_config(const FilterConfig* fltCfg)
+{
+    FilterConfig* copy = create_config();
+    size_t portsSize = sizeof(unsigned int) * fltCfg->numBlockedInboundTcpPorts;
+    size_t addedSize = sizeof(unsigned int) * fltCfg->numAddedIpAddresses;
+    size_t removedSize = sizeof(unsigned int) * fltCfg->numRemovedIpAddresses;
+
+    if(copy == NULL)
+        return NULL;
+    *copy = *fltCfg;
+    copy->blockedInboundTcpPorts = NULL;
+    copy->addedIpAddresses = NULL;
+    copy->removedIpAddresses = NULL;
+    // the caller builds a new jit once it is done changing the copy
+    copy->jit = NULL;
+    copy->jitFn = NULL;
+    // updates never change the merged addresses or the patterns in place, so
+    // the copy shares them; one that was never read has none to share
+    if(copy->ipRefs != NULL)
+        atomic_fetch_add(copy->ipRefs, 1);
+    if(copy->payloads != NULL)
+        atomic_fetch_add(&copy->payloads->refs, 1);
+
+    // the +1 keeps malloc from returning NULL for empty arrays
+    copy->blockedInboundTcpPorts = malloc(portsSize + 1);
+    copy->addedIpAddresses = malloc(addedSize + 1);
+    copy->removedIpAddresses = malloc(removedSize + 1);
+    if(copy->blockedInboundTcpPorts == NULL || copy->addedIpAddresses == NULL ||
+       copy->removedIpAddresses == NULL)
+    {
+        perror("Error copying filter");
+        destroy_config(copy);
+        return NULL;
+    }
+    // an empty array of the original may never have been allocated
+    if(portsSize > 0)
+        memcpy(copy->blockedInboundTcpPorts, fltCfg->blockedInboundTcpPorts, portsSize);
+    if(addedSize > 0)
+        memcpy(copy->addedIpAddresses, fltCfg->addedIpAddresses, addedSize);
+    if(removedSize > 0)
+        memcpy(copy->removedIpAddresses, fltCfg->removedIpAddresses, removedSize);
+    return copy;
+}
+
+
+/// Compares two IP addresses for qsort.
+/// @param a Pointer to the first address
+/// @param b Pointer to the second address
+/// @return Negative, zero or positive as a is less, equal or greater than b
+static int compare_ip_addresses(const void* a, const void* b)
+{
+    unsigned int addrA = *(const unsigned int*)a;
+    unsigned int addrB = *(const unsigned int*)b;
+    return (addrA > addrB) - (addrA < addrB);
+}
+
+
+/// Builds the Bloom filter in front of the blocked IP addresses of a
+/// configuration, if there are enough of them for it to pay off and
+/// NO_IP_BLOOM is not set.
+/// @param fltCfg The configuration, whose blocked addresses are sorted
+/// @return False if memory ran out
+static bool build_ip_bloom(FilterConfig* fltCfg)
+{
+    if(fltCfg->ipBloom != NULL)
+        destroy_ip_bloom(fltCfg->ipBloom);
+    fltCfg->ipBloom = NULL;
+    if(fltCfg->noIpBloom || fltCfg->numBlockedIpAddresses < BLOOM_MIN_ADDRESSES)
+        return true;
+    fltCfg->ipBloom = create_ip_bloom(fltCfg->blockedIpAddresses,
+                                      fltCfg->numBlockedIpAddresses);
+    return fltCfg->ipBloom != NULL;
+}
+
+
+/// Sorts the blocked IP addresses read from a configuration file, drops
+/// duplicates, and builds the Bloom filter in front of them. From then on
+/// they can be shared by copies of the configuration.
+/// @param fltCfg The configuration that was just read
+/// @return False if memory ran out
+static bool prepare_blocked_ip_addresses(FilterConfig* fltCfg)
+{
+    unsigned int numUnique = 0;
+
+    fltCfg->ipRefs = malloc(sizeof(atomic_uint));
+    if(fltCfg->ipRefs == NULL)
+    {
+        perror("Error reading filter configuration");
+        return false;
+    }
+    atomic_init(fltCfg->ipRefs, 1);
+
+    qsort(fltCfg->blockedIpAddresses, fltCfg->numBlockedIpAddresses,
+          sizeof(unsigned int), compare_ip_addresses);
+    for(unsigned int i = 0; i < fltCfg->numBlockedIpAddresses; ++i)
+    {
+        if(numUnique == 0 ||
+           fltCfg->blockedIpAddresses[i] != fltCfg->blockedIpAddresses[numUnique - 1])
+            fltCfg->blockedIpAddresses[numUnique++] = fltCfg->blockedIpAddresses[i];
+    }
+    fltCfg->numBlockedIpAddresses = numUnique;
+    return build_ip_bloom(fltCfg);
+}
+
+
+/// Decodes the pattern of a BLOCK_PAYLOAD setting and adds it to the list.
+/// The pattern is the rest of the line without trailing spaces and tabs;
+/// \xHH stands for the byte with hex value HH and \\ for a backslash,
+/// everything else stands for itself. A pattern that ends in a space has to
+/// write it as \x20.
+/// @param list The patterns read so far
+/// @param text The pattern as written in the configuration file
+/// @return False if the pattern is empty or memory ran out
+static bool add_payload_pattern(PatternList* list, const char* text)
+{
+    unsigned int newSize = list->numPatterns + 1;
+    unsigned char* pattern = malloc(strlen(text) + 1);
+    unsigned int length = 0;
+    // length up to the last byte that isn't trailing whitespace
+    unsigned int kept = 0;
+
+    if(pattern == NULL)
+    {
+        perror("Error reading payload pattern");
+        return false;
+    }
+    while(*text != '\0' && *text != '\n' && *text != '\r')
+    {
+        if(text[0] == '\\' && text[1] == 'x' &&
+           isxdigit((unsigned char)text[2]) && isxdigit((unsigned char)text[3]))
+        {
+            char hex[3] = { text[2], text[3], '\0' };
+            pattern[length++] = strtoul(hex, NULL, 16);
+            text += 4;
+            kept = length;
+        }
+        else if(text[0] == '\\' && text[1] == '\\')
+        {
+            pattern[length++] = '\\';
+            text += 2;
+            kept = length;
+        }
+        else
+        {
+            pattern[length++] = *text;
+            if(*text != ' ' && *text != '\t')
+                kept = length;
+            ++text;
+        }
+    }
+    length = kept;
+    if(length == 0)
+    {
+        fprintf(stderr, "ERROR: empty BLOCK_PAYLOAD pattern\n");
+        free(pattern);
+        return false;
+    }
+
+    // grows both arrays by one, like the other blocked lists
+    list->patterns = realloc(list->patterns, sizeof(unsigned char*) * newSize);
+    list->lengths = realloc(list->lengths, sizeof(unsigned int) * newSize);
+    list->patterns[newSize - 1] = pattern;
+    list->lengths[newSize - 1] = length;
+    list->numPatterns = newSize;
+    return true;
+}
+
+
+/// Frees the patterns read from a configuration file.
+/// @param list The patterns
+static void free_pattern_list(PatternList* list)
+{
+    for(unsigned int i = 0; i < list->numPatterns; ++i)
+        free(list->patterns[i]);
+    free(list->patterns);
+    free(list->lengths);
+}
+
+
+/// Compiles the patterns read from a configuration file into the scanner
+/// the configuration uses, if there are any.
+/// @param fltCfg The configuration that was just read
+/// @param list The patterns
+/// @return False if memory ran out
+static bool build_payload_patterns(FilterConfig* fltCfg, PatternList* list)
+{
+    if(list->numPatterns == 0)
+        return true;
+
+    fltCfg->payloads = malloc(sizeof(PayloadPatterns));
+    if(fltCfg->payloads == NULL)
+    {
+        perror("Error creating payload scanner");
+        return false;
+    }
+    atomic_init(&fltCfg->payloads->refs, 1);
+    fltCfg->payloads->numPatterns = list->numPatterns;
+    fltCfg->payloads->scanner = create_payload_scanner(
+        (const unsigned char* const*)list->patterns, list->lengths,
+        list->numPatterns);
+    if(fltCfg->payloads->scanner == NULL)
+    {
+        free(fltCfg->payloads);
+        fltCfg->payloads = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+/// Makes a configuration the one used by the filter, then frees the one it
+/// replaces as soon as filter_packet is no longer using it. filter_packet is
+/// never paused; only the caller waits, and only for the packet in progress.
+/// @param flt The filter to update
+/// @param fltCfg The new configuration
+/// @pre caller holds the updateLock of the filter
+static void publish_config(Filter* flt, FilterConfig* fltCfg)
+{
+    FilterConfig* old;
+
+    fltCfg->bloomStats = &flt->bloomStats;
+    old = atomic_exchange(&flt->active, fltCfg);
+    unsigned int seq = atomic_load(&flt->readerSeq);
+
+    // an odd sequence means a packet may still be looking at the old one
+    if(seq & 1)
+    {
+        while(atomic_load(&flt->readerSeq) == seq)
+            sched_yield();
+    }
+    destroy_config(old);
+}
+
+
+/// Creates an instance of a filter by allocating memory for a Filter and
+/// an empty FilterConfig.
 /// @return A pointer to the new filter
 IpPktFilter create_filter(void)
 {
-    FilterConfig* filter = NULL;
+    Filter* flt = NULL;
     // allocates enough space for filter
-    filter = malloc(sizeof(FilterConfig));
+    flt = malloc(sizeof(Filter));
 
     // checks to make sure malloc was successful
-    if(filter == NULL)
+    if(flt == NULL)
     {
         perror("Error creating filter");
         return NULL;
     }
 
-    // if we get here malloc was successful; we can set defaults
-    filter->localIpAddr = 0;
-    filter->localMask = 0;
-    filter->blockInboundEchoReq = false;
-    filter->numBlockedInboundTcpPorts = 0;
-    filter->blockedInboundTcpPorts = NULL;
-    filter->numBlockedIpAddresses = 0;
-    filter->blockedIpAddresses = NULL;
+    // starts out with a configuration that blocks nothing
+    atomic_init(&flt->active, create_config());
+    if(atomic_load(&flt->active) == NULL)
+    {
+        free(flt);
+        return NULL;
+    }
+    flt->frags = create_frag_table(FRAG_TABLE_ENTRIES, FRAG_TIMEOUT);
+    if(flt->frags == NULL)
+    {
+        destroy_config(atomic_load(&flt->active));
+        free(flt);
+        return NULL;
+    }
+    atomic_init(&flt->readerSeq, 0);
+    pthread_mutex_init(&flt->updateLock, NULL);
+    atomic_init(&flt->ruleOrder, DEFAULT_RULE_ORDER);
+    flt->sampleCount = 0;
+    atomic_init(&flt->numSampled, 0);
+    flt->lastSampled = 0;
+    atomic_init(&flt->bloomStats.queries, 0);
+    atomic_init(&flt->bloomStats.maybeHits, 0);
+    atomic_init(&flt->bloomStats.hits, 0);
+    atomic_init(&flt->payloadsScanned, 0);
+    atomic_init(&flt->payloadsBlocked, 0);
+    atomic_init(&flt->payloadsMalformed, 0);
+    atomic_init(&flt->truncated, 0);
+    for(int rule = 0; rule < NUM_RULES; ++rule)
+    {
+        atomic_init(&flt->ruleStats[rule].hits, 0);
+        flt->ruleStats[rule].lastHits = 0;
+        flt->ruleStats[rule].score = 0;
+    }
 
     // return our newly created filter
-    return (IpPktFilter) filter;
+    return (IpPktFilter) flt;
 }
 
 
@@ -183,16 +834,120 @@ IpPktFilter create_filter(void)
 /// @param filter The filter that is to be destroyed
 void destroy_filter(IpPktFilter filter)
 {
-    FilterConfig* fltCfg = filter;
+    Filter* flt = filter;
 
-    // frees our arrays if they need to be
-    if(fltCfg->blockedInboundTcpPorts != NULL)
-        free(fltCfg->blockedInboundTcpPorts);
-    if(fltCfg->blockedIpAddresses != NULL)
-        free(fltCfg->blockedIpAddresses);
+    // frees the configuration and its arrays
+    destroy_config(atomic_load(&flt->active));
+    destroy_frag_table(flt->frags);
+    pthread_mutex_destroy(&flt->updateLock);
 
     // we've now free'd everything that needs to be, we can now free filter
-    free(filter);
+    free(flt);
+}
+
+
+/// Uses the settings specified by the filter configuration to determine
+/// if a packet should be allowed or blocked.
+static bool check_packet(FilterConfig* fltCfg, unsigned char* pkt);
+
+
+/// Checks a freshly compiled filter against the interpreter, check_packet,
+/// on random packets built around the configured addresses and ports so
+/// that every branch of the compiled code is taken.
+/// @param fltCfg The configuration the filter was compiled from
+/// @return True if the two agreed on every packet
+static bool verify_filter_jit(FilterConfig* fltCfg)
+{
+    unsigned char pkt[64];
+    unsigned int seed = 243;
+    unsigned int local = fltCfg->localIpAddr;
+    unsigned int outside = fltCfg->localIpAddr ^ ~fltCfg->localMask ^ 0x80000000;
+
+    for(int n = 0; n < JIT_VERIFY_PACKETS; ++n)
+    {
+        unsigned int addrs[2];
+
+        memset(pkt, 0, sizeof(pkt));
+        for(int i = 0; i < 2; ++i)
+        {
+            seed = seed * 1103515245 + 12345;
+            switch(seed >> 28 & 3)
+            {
+                case 0:
+                    addrs[i] = local ^ (seed & ~fltCfg->localMask);
+                    break;
+                case 1:
+                    addrs[i] = outside ^ (seed & 0xff);
+                    break;
+                case 2:
+                    addrs[i] = fltCfg->numBlockedIpAddresses == 0 ? seed :
+                               fltCfg->blockedIpAddresses[(seed >> 8) %
+                                   fltCfg->numBlockedIpAddresses] + (seed & 1);
+                    break;
+                default:
+                    addrs[i] = seed * 2654435761U;
+            }
+            for(int b = 0; b < 4; ++b)
+                pkt[12 + 4 * i + b] = addrs[i] >> (24 - 8 * b);
+        }
+
+        seed = seed * 1103515245 + 12345;
+        static const unsigned char protocols[] =
+            { IP_PROTOCOL_ICMP, IP_PROTOCOL_TCP, IP_PROTOCOL_UDP, 0 };
+        pkt[0] = 0x45;
+        pkt[9] = protocols[seed >> 28 & 3];
+        pkt[20] = (seed >> 24 & 1) ? ICMP_TYPE_ECHO_REQ : seed >> 16;
+        unsigned int port = seed & 0xffff;
+        if((seed >> 25 & 1) && fltCfg->numBlockedInboundTcpPorts > 0)
+            port = fltCfg->blockedInboundTcpPorts[(seed >> 8) %
+                       fltCfg->numBlockedInboundTcpPorts] + (seed >> 26 & 1);
+        pkt[22] = port >> 8;
+        pkt[23] = port;
+
+        if(fltCfg->jitFn(pkt) != check_packet(fltCfg, pkt))
+            return false;
+    }
+    return true;
+}
+
+
+/// Compiles a configuration to native code if it asked for that and is
+/// small enough. The interpreter stays in use if compiling fails or the
+/// compiled code disagrees with it.
+/// @param fltCfg The configuration to compile
+static void build_filter_jit(FilterConfig* fltCfg)
+{
+    FilterRules rules = { fltCfg->localIpAddr, fltCfg->localMask,
+                          fltCfg->blockInboundEchoReq,
+                          fltCfg->numBlockedInboundTcpPorts,
+                          fltCfg->blockedInboundTcpPorts,
+                          fltCfg->numBlockedIpAddresses,
+                          fltCfg->blockedIpAddresses,
+                          fltCfg->payloads != NULL ?
+                              fltCfg->payloads->numPatterns : 0 };
+
+    if(fltCfg->jit != NULL)
+        destroy_filter_jit(fltCfg->jit);
+    fltCfg->jit = NULL;
+    fltCfg->jitFn = NULL;
+    // lists this short are merged on every update, longer ones are not
+    // compiled anyway
+    if(!fltCfg->jitCompile || fltCfg->numAddedIpAddresses > 0 ||
+       fltCfg->numRemovedIpAddresses > 0)
+        return;
+
+    fltCfg->jit = create_filter_jit(&rules);
+    if(fltCfg->jit == NULL)
+        return;
+    fltCfg->jitFn = filter_jit_function(fltCfg->jit);
+    if(!verify_filter_jit(fltCfg))
+    {
+        fprintf(stderr, "fw: compiled filter disagrees with interpreter, "
+                "not using it\n");
+        destroy_filter_jit(fltCfg->jit);
+        fltCfg->jit = NULL;
+        fltCfg->jitFn = NULL;
+    }
 }
 
 
@@ -216,8 +971,9 @@ static unsigned int extractLocalMask()
 /// Configures a filter instance using the specified configuration file.
 /// Reads the file line by line and uses strtok, strcmp, and sscanf to
 /// parse each line.  After each line is successfully parsed the result
-/// is stored in the filter.  Blank lines are skipped.  When the end of
-/// the file is encountered, the file is closed and the function returns.
+/// is stored in a new configuration.  Blank lines are skipped.  When the
+/// end of the file is encountered, the file is closed and, if the file was
+/// valid, the new configuration replaces the one the filter was using.
 /// @param filter The filter that is to be configured
 /// @param filename The full path/filename of the configuration file that
 /// is to be read.
@@ -229,10 +985,15 @@ bool configure_filter(IpPktFilter filter, char* filename)
     // the file pointer to the configuration file
     FILE* pFile;
 
-    FilterConfig *fltCfg = (FilterConfig *) filter;
+    Filter* flt = (Filter *) filter;
+    FilterConfig *fltCfg;
+    // the payload patterns, compiled together once the file is read
+    PatternList payloadPatterns = { 0, NULL, NULL };
 
     // boolean to determine if the configuration was valid or not
     bool validConfig = false;
+    // false once a payload pattern could not be read
+    bool validPayloads = true;
 
     pFile = fopen(filename, "r");
     if(pFile == NULL)
@@ -241,6 +1002,14 @@ bool configure_filter(IpPktFilter filter, char* filename)
         return false;
     }
 
+    // the new settings are built up separately from the ones in use
+    fltCfg = create_config();
+    if(fltCfg == NULL)
+    {
+        fclose(pFile);
+        return false;
+    }
+
     // keeps going until we break
     while(true)
     {
@@ -256,7 +1025,18 @@ bool configure_filter(IpPktFilter filter, char* filename)
         if(buf[0] == '\n')
             continue;
 
-        // figures out what the read line is setting
+        // figures out what the read line is setting; a payload pattern may
+        // contain the name of another setting, so this one is checked first
+        if(strstr(buf, "BLOCK_PAYLOAD") != NULL)
+        {
+            // the pattern starts after the space following the colon
+            char* pattern = strstr(buf, " ");
+            // adds the pattern to the list, which is compiled at the end
+            if(pattern == NULL || !add_payload_pattern(&payloadPatterns, pattern + 1))
+                validPayloads = false;
+            // continues to the next iteration
+            continue;
+        }
         if(strstr(buf, "LOCAL_NET") != NULL)
         {
             // used to set our ip address
@@ -303,7 +1083,35 @@ bool configure_filter(IpPktFilter filter, char* filename)
         {
             // sets true to block inbound echo requests
             fltCfg->blockInboundEchoReq = true;
-            // no continue statement here because it's the end of the stack
+            // continues to the next iteration
+            continue;
+        }
+        if(strstr(buf, "ADAPTIVE_RULE_ORDER") != NULL)
+        {
+            // sets true to order the rules by how often they match
+            fltCfg->adaptiveRuleOrder = true;
+            // continues to the next iteration
+            continue;
+        }
+        if(strstr(buf, "JIT_COMPILE") != NULL)
+        {
+            // sets true to compile the rules to native code
+            fltCfg->jitCompile = true;
+            // continues to the next iteration
+            continue;
+        }
+        if(strstr(buf, "GENERIC_CHECK") != NULL)
+        {
+            // sets true to check every rule the general way
+            fltCfg->genericCheck = true;
+            // continues to the next iteration
+            continue;
+        }
+        if(strstr(buf, "NO_IP_BLOOM") != NULL)
+        {
+            // sets true to binary search every address lookup
+            fltCfg->noIpBloom = true;
+            // continues to the next iteration
             continue;
         }
     }
@@ -314,25 +1122,45 @@ bool configure_filter(IpPktFilter filter, char* filename)
     if(validConfig == false)
         fprintf(stderr, "ERROR: configuration file must set LOCAL_NET\n");
 
+    /* sorts the blocked addresses and puts the bloom in front of them, then
+       compiles the payload patterns */
+    if(!validConfig || !validPayloads || !prepare_blocked_ip_addresses(fltCfg) ||
+       !build_payload_patterns(fltCfg, &payloadPatterns))
+    {
+        free_pattern_list(&payloadPatterns);
+        destroy_config(fltCfg);
+        return false;
+    }
+    free_pattern_list(&payloadPatterns);
+    select_check_variant(fltCfg);
+    build_filter_jit(fltCfg);
+
+    // swaps in the new configuration
+    pthread_mutex_lock(&flt->updateLock);
+    publish_config(flt, fltCfg);
+    pthread_mutex_unlock(&flt->updateLock);
+
     // returns true if valid false if no LOCAL_NET was set in the config file
     return validConfig;
 }
 
 
-/// Uses the settings specified by the filter instance to determine
+/// Uses the settings specified by the filter configuration to determine
 /// if a packet should be allowed or blocked.  The source and
 /// destination IP addresses are extracted from each packet and
 /// checked using the block_ip_address helper function. The IP protocol
 /// is extracted from the packet and if it is ICMP or TCP then
 /// additional processing occurs. This processing blocks inbound packets
 /// set to blocked TCP destination ports and inbound ICMP echo requests.
-/// @param filter The filter configuration to use
+/// filter_packet uses the variants below, built for the rules in use, unless
+/// GENERIC_CHECK is set; this general version is what compiled code is
+/// checked against.
+/// @param fltCfg The filter configuration to use
 /// @param pkt The packet to examine
 /// @return True if the packet is allowed by the filter. False if the packet
 /// is to be blocked
-bool filter_packet(IpPktFilter filter, unsigned char* pkt)
+static bool check_packet(FilterConfig* fltCfg, unsigned char* pkt)
 {
-    FilterConfig* fltCfg = (FilterConfig*)filter;
     unsigned int srcIpAddr = ExtractSrcAddrFromIpHeader(pkt);
     unsigned int dstIpAddr = ExtractDstAddrFromIpHeader(pkt);
     unsigned int IpProtocol = ExtractIpProtocol(pkt);
@@ -366,3 +1194,844 @@ bool filter_packet(IpPktFilter filter, unsigned char* pkt)
             return true;
     }
 }
+
+
+/// Looks up an IP address the way a variant of check_packet was built to.
+/// @param fltCfg The filter configuration to use
+/// @param addr The IP address that is to be checked
+/// @param ipLookup How the variant looks addresses up
+/// @return True if the IP address is to be blocked
+static inline __attribute__((always_inline))
+bool block_ip_address_with(FilterConfig* fltCfg, unsigned int addr, IpLookup ipLookup)
+{
+    switch(ipLookup)
+    {
+        case IP_LOOKUP_SCAN:
+            // lists this short have nothing added or removed, see update_filter
+            for(unsigned int i = 0; i < fltCfg->numBlockedIpAddresses; ++i)
+                if(fltCfg->blockedIpAddresses[i] == addr)
+                    return true;
+            return false;
+        case IP_LOOKUP_SEARCH:
+            return ip_address_listed(fltCfg, addr);
+        case IP_LOOKUP_BLOOM:
+            return block_ip_address(fltCfg, addr);
+        default:
+            return false;
+    }
+}
+
+
+/// The body of every variant of check_packet. The rules are arguments that
+/// each variant passes as constants, and since this is always inlined the
+/// compiler drops the code of the rules a variant leaves out, down to the
+/// header fields only they read.
+/// @param fltCfg The filter configuration to use
+/// @param pkt The packet to examine
+/// @param ipLookup How blocked addresses are looked up
+/// @param tcpPorts True if some inbound TCP ports are blocked
+/// @param echoReq True if inbound echo requests are blocked
+/// @return True if the packet is allowed by the filter
+static inline __attribute__((always_inline))
+bool check_packet_with(FilterConfig* fltCfg, unsigned char* pkt,
+                       IpLookup ipLookup, bool tcpPorts, bool echoReq)
+{
+    unsigned int srcIpAddr = 0, dstIpAddr = 0, IpProtocol;
+
+    if(ipLookup != IP_LOOKUP_NONE)
+    {
+        srcIpAddr = ExtractSrcAddrFromIpHeader(pkt);
+        dstIpAddr = ExtractDstAddrFromIpHeader(pkt);
+        if(block_ip_address_with(fltCfg, srcIpAddr, ipLookup) ||
+           block_ip_address_with(fltCfg, dstIpAddr, ipLookup))
+            return false;
+    }
+    if(!tcpPorts && !echoReq)
+        return true;
+
+    // only the protocols with a rule need to know which way they are going
+    IpProtocol = ExtractIpProtocol(pkt);
+    if(!(echoReq && IpProtocol == IP_PROTOCOL_ICMP) &&
+       !(tcpPorts && IpProtocol == IP_PROTOCOL_TCP))
+        return true;
+    if(ipLookup == IP_LOOKUP_NONE)
+    {
+        srcIpAddr = ExtractSrcAddrFromIpHeader(pkt);
+        dstIpAddr = ExtractDstAddrFromIpHeader(pkt);
+    }
+    if(!packet_is_inbound(fltCfg, srcIpAddr, dstIpAddr))
+        return true;
+    if(IpProtocol == IP_PROTOCOL_ICMP)
+        return ExtractIcmpType(pkt) != ICMP_TYPE_ECHO_REQ;
+    return !block_inbound_tcp_port(fltCfg, ExtractTcpDstPort(pkt));
+}
+
+
+/// Defines a variant of check_packet for one combination of rules.
+#define DEFINE_CHECK_VARIANT(name, ipLookup, tcpPorts, echoReq)              \
+    static bool name(FilterConfig* fltCfg, unsigned char* pkt)                \
+    {                                                                         \
+        return check_packet_with(fltCfg, pkt, ipLookup, tcpPorts, echoReq);   \
+    }
+
+/// Defines the four variants of check_packet for one IP lookup.
+#define DEFINE_CHECK_VARIANTS(name, ipLookup)                                \
+    DEFINE_CHECK_VARIANT(check_##name, ipLookup, false, false)                \
+    DEFINE_CHECK_VARIANT(check_##name##_echo, ipLookup, false, true)          \
+    DEFINE_CHECK_VARIANT(check_##name##_ports, ipLookup, true, false)         \
+    DEFINE_CHECK_VARIANT(check_##name##_ports_echo, ipLookup, true, true)
+
+DEFINE_CHECK_VARIANTS(no_ips, IP_LOOKUP_NONE)
+DEFINE_CHECK_VARIANTS(scanned_ips, IP_LOOKUP_SCAN)
+DEFINE_CHECK_VARIANTS(searched_ips, IP_LOOKUP_SEARCH)
+DEFINE_CHECK_VARIANTS(bloom_ips, IP_LOOKUP_BLOOM)
+
+/// the variants of check_packet, by IP lookup, blocked TCP ports and
+/// blocked echo requests
+static const CheckFn checkVariants[NUM_IP_LOOKUPS][2][2] =
+{
+    { { check_no_ips, check_no_ips_echo },
+      { check_no_ips_ports, check_no_ips_ports_echo } },
+    { { check_scanned_ips, check_scanned_ips_echo },
+      { check_scanned_ips_ports, check_scanned_ips_ports_echo } },
+    { { check_searched_ips, check_searched_ips_echo },
+      { check_searched_ips_ports, check_searched_ips_ports_echo } },
+    { { check_bloom_ips, check_bloom_ips_echo },
+      { check_bloom_ips_ports, check_bloom_ips_ports_echo } }
+};
+
+
+/// Installs the variant of check_packet that checks only the rules the
+/// configuration has, with the address lookup that suits how many
+/// addresses it blocks, or check_packet with GENERIC_CHECK. Called whenever
+/// the rules of a configuration are final, before it is published.
+/// @param fltCfg The configuration
+static void select_check_variant(FilterConfig* fltCfg)
+{
+    unsigned int numBlocked = count_blocked_ip_addresses(fltCfg);
+
+    if(numBlocked == 0)
+        fltCfg->ipLookup = IP_LOOKUP_NONE;
+    else if(fltCfg->ipBloom != NULL)
+        fltCfg->ipLookup = IP_LOOKUP_BLOOM;
+    else if(numBlocked <= MAX_SCANNED_ADDRESSES)
+        fltCfg->ipLookup = IP_LOOKUP_SCAN;
+    else
+        fltCfg->ipLookup = IP_LOOKUP_SEARCH;
+    if(fltCfg->genericCheck)
+        fltCfg->checkFn = check_packet;
+    else
+        fltCfg->checkFn = checkVariants[fltCfg->ipLookup]
+                                       [fltCfg->numBlockedInboundTcpPorts > 0]
+                                       [fltCfg->blockInboundEchoReq];
+}
+
+
+/// Checks a single rule against a packet.
+/// @param fltCfg The filter configuration to use
+/// @param rule The rule to check
+/// @param info What is known about the packet so far
+/// @return True if the rule matches and the packet is to be blocked
+static bool match_rule(FilterConfig* fltCfg, FilterRule rule, PacketInfo* info)
+{
+    switch(rule)
+    {
+        case RULE_SRC_IP:
+            return block_ip_address(fltCfg, info->srcIpAddr);
+        case RULE_DST_IP:
+            return block_ip_address(fltCfg, info->dstIpAddr);
+        case RULE_ECHO_REQ:
+            if(!fltCfg->blockInboundEchoReq ||
+               ExtractIpProtocol(info->pkt) != IP_PROTOCOL_ICMP)
+                return false;
+            break;
+        case RULE_TCP_PORT:
+            if(fltCfg->numBlockedInboundTcpPorts == 0 ||
+               ExtractIpProtocol(info->pkt) != IP_PROTOCOL_TCP)
+                return false;
+            break;
+        default:
+            return false;
+    }
+
+    // both protocol rules only apply to inbound packets
+    if(info->inbound == -1)
+        info->inbound = packet_is_inbound(fltCfg, info->srcIpAddr,
+                                          info->dstIpAddr);
+    if(!info->inbound)
+        return false;
+    if(rule == RULE_ECHO_REQ)
+        return ExtractIcmpType(info->pkt) == ICMP_TYPE_ECHO_REQ;
+    return block_inbound_tcp_port(fltCfg, ExtractTcpDstPort(info->pkt));
+}
+
+
+/// Checks a packet with the rules in the order reorder_filter_rules last
+/// chose. One in every RULE_SAMPLE_RATE packets has every rule checked,
+/// whether an earlier one matched or not, so the hit rates it records do not
+/// depend on the current order.
+/// @param flt The filter, which holds the rule order and statistics
+/// @param fltCfg The filter configuration to use
+/// @param pkt The packet to examine
+/// @return True if the packet is allowed by the filter. False if the packet
+/// is to be blocked
+static bool check_packet_adaptive(Filter* flt, FilterConfig* fltCfg,
+                                  unsigned char* pkt)
+{
+    PacketInfo info = { pkt, ExtractSrcAddrFromIpHeader(pkt),
+                        ExtractDstAddrFromIpHeader(pkt), -1 };
+
+    if(++flt->sampleCount == RULE_SAMPLE_RATE)
+    {
+        bool blocked = false;
+
+        flt->sampleCount = 0;
+        for(int rule = 0; rule < NUM_RULES; ++rule)
+        {
+            if(match_rule(fltCfg, rule, &info))
+            {
+                add_count(&flt->ruleStats[rule].hits, 1);
+                blocked = true;
+            }
+        }
+        add_count(&flt->numSampled, 1);
+        return !blocked;
+    }
+
+    // the order is a single self contained value, so relaxed is enough
+    unsigned int order = atomic_load_explicit(&flt->ruleOrder,
+                                              memory_order_relaxed);
+    for(int i = 0; i < NUM_RULES; ++i, order >>= RULE_BITS)
+    {
+        if(match_rule(fltCfg, order & ((1 << RULE_BITS) - 1), &info))
+            return false;
+    }
+    return true;
+}
+
+
+/// Searches the payload of an inbound TCP or UDP packet for the blocked
+/// patterns. The payload ends where the IP header says the packet does,
+/// unless fewer bytes than that were received. A fragment after the first
+/// has no transport header; all of it is payload. A TCP header shorter than
+/// 5 words or longer than the packet is malformed, and blocked the way a
+/// packet cut short is, since there is no telling where its payload starts.
+/// @param flt The filter, which counts the payloads searched
+/// @param fltCfg The filter configuration to use
+/// @param pkt The packet to examine
+/// @param length The number of bytes received
+/// @return True if the payload holds a blocked pattern or is malformed
+static bool block_payload(Filter* flt, FilterConfig* fltCfg, unsigned char* pkt,
+                          unsigned int length)
+{
+    unsigned int ipLength, protocol, start;
+
+    if(length < IP_HEADER_LEN)
+        return false;
+    ipLength = (unsigned int)pkt[2] << 8 | pkt[3];
+    if(ipLength < length)
+        length = ipLength;
+
+    protocol = ExtractIpProtocol(pkt);
+    if((protocol != IP_PROTOCOL_TCP && protocol != IP_PROTOCOL_UDP) ||
+       !packet_is_inbound(fltCfg, ExtractSrcAddrFromIpHeader(pkt),
+                          ExtractDstAddrFromIpHeader(pkt)))
+        return false;
+    if(IP_FRAG_FIELD(pkt) & IP_FRAG_OFFSET)
+        start = IP_HEADER_LEN;
+    else if(protocol == IP_PROTOCOL_UDP)
+        start = IP_HEADER_LEN + UDP_HEADER_LEN;
+    else if(length > IP_HEADER_LEN + TCP_DATA_OFFSET)
+    {
+        unsigned int dataOffset = pkt[IP_HEADER_LEN + TCP_DATA_OFFSET] >> 4;
+
+        start = IP_HEADER_LEN + dataOffset * 4;
+        if(dataOffset < 5 || start > ipLength)
+        {
+            add_count(&flt->payloadsMalformed, 1);
+            return true;
+        }
+    }
+    else
+        return false;
+    if(start >= length)
+        return false;
+
+    add_count(&flt->payloadsScanned, 1);
+    if(!payload_scanner_match(fltCfg->payloads->scanner, pkt + start, length - start))
+        return false;
+    add_count(&flt->payloadsBlocked, 1);
+    return true;
+}
+
+
+/// Estimates how much work checking a rule takes with a configuration.
+/// @param fltCfg The filter configuration
+/// @param rule The rule
+/// @return The relative cost of checking the rule
+static double rule_cost(FilterConfig* fltCfg, FilterRule rule)
+{
+    switch(rule)
+    {
+        case RULE_SRC_IP:
+        case RULE_DST_IP:
+            // a bloom lookup, or a binary search of the sorted array
+            if(fltCfg->ipBloom != NULL)
+                return 3;
+            double cost = 1;
+            for(unsigned int n = count_blocked_ip_addresses(fltCfg); n > 0; n >>= 1)
+                ++cost;
+            return cost;
+        case RULE_TCP_PORT:
+            return 2 + fltCfg->numBlockedInboundTcpPorts;
+        default:
+            return 2;
+    }
+}
+
+
+/// Recomputes the order adaptive mode checks rules in from the statistics
+/// sampled since the last call. Each rule is scored by its hit rate divided
+/// by its cost, smoothed over calls, and rules are checked best score first;
+/// checking the rules that most often end the search cheaply first does the
+/// least work. The new order is published for filter_packet to pick up on
+/// its next packet.
+/// @param filter The filter whose rules are to be reordered
+void reorder_filter_rules(IpPktFilter filter)
+{
+    Filter* flt = filter;
+    FilterRule order[NUM_RULES];
+    unsigned int packed = 0;
+
+    pthread_mutex_lock(&flt->updateLock);
+    FilterConfig* fltCfg = atomic_load(&flt->active);
+    unsigned long sampled = atomic_load_explicit(&flt->numSampled,
+                                                 memory_order_relaxed);
+    unsigned long numSampled = sampled - flt->lastSampled;
+
+    if(!fltCfg->adaptiveRuleOrder || numSampled == 0)
+    {
+        pthread_mutex_unlock(&flt->updateLock);
+        return;
+    }
+    flt->lastSampled = sampled;
+
+    for(int rule = 0; rule < NUM_RULES; ++rule)
+    {
+        RuleStats* stats = &flt->ruleStats[rule];
+        unsigned long hits = atomic_load_explicit(&stats->hits,
+                                                  memory_order_relaxed);
+        double rate = (double)(hits - stats->lastHits) / numSampled;
+
+        stats->lastHits = hits;
+        stats->score = (stats->score + rate / rule_cost(fltCfg, rule)) / 2;
+
+        // insertion sort, best score first, ties keep the default order
+        int i = rule;
+        for(; i > 0 && flt->ruleStats[order[i - 1]].score < stats->score; --i)
+            order[i] = order[i - 1];
+        order[i] = rule;
+    }
+
+    for(int i = NUM_RULES - 1; i >= 0; --i)
+        packed = packed << RULE_BITS | order[i];
+    atomic_store_explicit(&flt->ruleOrder, packed, memory_order_relaxed);
+    pthread_mutex_unlock(&flt->updateLock);
+}
+
+
+/// Checks the configuration in use for ADAPTIVE_RULE_ORDER.
+/// @param filter The filter to check
+/// @return True if its rules are to be reordered
+bool filter_adapts_rule_order(IpPktFilter filter)
+{
+    Filter* flt = filter;
+    bool adaptive;
+
+    // the lock keeps an update from freeing the configuration meanwhile
+    pthread_mutex_lock(&flt->updateLock);
+    adaptive = atomic_load(&flt->active)->adaptiveRuleOrder;
+    pthread_mutex_unlock(&flt->updateLock);
+    return adaptive;
+}
+
+
+/// Lists the IP addresses a configuration blocks, in order, by merging the
+/// added addresses into the merged ones and leaving out the removed ones.
+/// @param fltCfg The configuration
+/// @param addrs Where the count_blocked_ip_addresses addresses are written
+static void list_blocked_ip_addresses(const FilterConfig* fltCfg, unsigned int* addrs)
+{
+    unsigned int merged = 0, added = 0, removed = 0, n = 0;
+
+    while(merged < fltCfg->numBlockedIpAddresses || added < fltCfg->numAddedIpAddresses)
+    {
+        if(merged == fltCfg->numBlockedIpAddresses ||
+           (added < fltCfg->numAddedIpAddresses &&
+            fltCfg->addedIpAddresses[added] < fltCfg->blockedIpAddresses[merged]))
+            addrs[n++] = fltCfg->addedIpAddresses[added++];
+        else if(removed < fltCfg->numRemovedIpAddresses &&
+                fltCfg->removedIpAddresses[removed] == fltCfg->blockedIpAddresses[merged])
+        {
+            ++merged;
+            ++removed;
+        }
+        else
+            addrs[n++] = fltCfg->blockedIpAddresses[merged++];
+    }
+}
+
+
+/// Adds a value to a sorted array of a configuration being updated.
+/// @param values The array, which has room for one more value
+/// @param numValues The number of values in it, counted up
+/// @param value The value, which is not listed yet
+static void insert_sorted_value(unsigned int* values, unsigned int* numValues,
+                                unsigned int value)
+{
+    unsigned int i = find_sorted_value(values, *numValues, value);
+
+    // shifts the larger values up to keep the array sorted
+    memmove(&values[i + 1], &values[i], sizeof(unsigned int) * (*numValues - i));
+    values[i] = value;
+    ++*numValues;
+}
+
+
+/// Takes a value out of a sorted array of a configuration being updated.
+/// @param values The array
+/// @param numValues The number of values in it, counted down
+/// @param value The value, which is listed
+static void erase_sorted_value(unsigned int* values, unsigned int* numValues,
+                               unsigned int value)
+{
+    unsigned int i = find_sorted_value(values, *numValues, value);
+
+    --*numValues;
+    memmove(&values[i], &values[i + 1], sizeof(unsigned int) * (*numValues - i));
+}
+
+
+/// Records that a copied configuration blocks an address it did not, or no
+/// longer blocks one it did. The change goes in the short sorted list of
+/// addresses added or removed since the merge, so that it costs a copy of
+/// that list rather than of every blocked address.
+/// @param fltCfg The copied configuration
+/// @param add True if ipAddr is to be blocked, false if it is to be unblocked
+/// @param ipAddr The IP address
+/// @return False if memory ran out
+static bool change_blocked_ip_address(FilterConfig* fltCfg, bool add,
+                                      unsigned int ipAddr)
+{
+    bool merged = sorted_value_listed(fltCfg->blockedIpAddresses,
+                                      fltCfg->numBlockedIpAddresses, ipAddr);
+
+    // re-adding a removed address, or removing an added one, undoes the change
+    if(add && merged)
+        erase_sorted_value(fltCfg->removedIpAddresses,
+                           &fltCfg->numRemovedIpAddresses, ipAddr);
+    else if(!add && !merged)
+        erase_sorted_value(fltCfg->addedIpAddresses,
+                           &fltCfg->numAddedIpAddresses, ipAddr);
+    else
+    {
+        unsigned int** values = add ? &fltCfg->addedIpAddresses :
+                                      &fltCfg->removedIpAddresses;
+        unsigned int* numValues = add ? &fltCfg->numAddedIpAddresses :
+                                        &fltCfg->numRemovedIpAddresses;
+        unsigned int* grown = realloc(*values, sizeof(unsigned int) * (*numValues + 1));
+
+        if(grown == NULL)
+        {
+            perror("Error updating filter");
+            return false;
+        }
+        *values = grown;
+        insert_sorted_value(grown, numValues, ipAddr);
+    }
+    return true;
+}
+
+
+/// Checks if the addresses added and removed since the merge are enough to
+/// be merged, as they are once they slow lookups down. Lists short enough to
+/// be scanned or compiled are kept merged at all times.
+/// @param fltCfg The configuration
+/// @return True if the addresses are to be merged
+static bool merge_due(const FilterConfig* fltCfg)
+{
+    uint64_t pending = (uint64_t)fltCfg->numAddedIpAddresses +
+                       fltCfg->numRemovedIpAddresses;
+
+    return pending > 0 &&
+           (pending >= MAX_PENDING_ADDRESSES ||
+            pending * 64 > fltCfg->numBlockedIpAddresses ||
+            count_blocked_ip_addresses(fltCfg) < BLOOM_MIN_ADDRESSES);
+}
+
+
+/// Merges the addresses added and removed since the last merge into a new
+/// sorted array of the configuration. The Bloom filter it shared gets the
+/// added addresses set in a copy, and is only rebuilt when there was none,
+/// addresses were removed, which a Bloom filter can't have taken out, or it
+/// would hold half again as many addresses as it was sized for, past which
+/// its false positive rate climbs over 1%.
+/// @param fltCfg The copied configuration
+/// @return False if memory ran out
+static bool merge_blocked_ip_addresses(FilterConfig* fltCfg)
+{
+    unsigned int numBlocked = count_blocked_ip_addresses(fltCfg);
+    unsigned int* addrs = malloc(sizeof(unsigned int) * numBlocked + 1);
+    atomic_uint* refs = malloc(sizeof(atomic_uint));
+    IpBloom bloom = NULL;
+
+    if(addrs == NULL || refs == NULL)
+    {
+        perror("Error updating filter");
+        free(addrs);
+        free(refs);
+        return false;
+    }
+    list_blocked_ip_addresses(fltCfg, addrs);
+    if(fltCfg->ipBloom != NULL && fltCfg->numRemovedIpAddresses == 0 &&
+       (uint64_t)numBlocked * 2 <= (uint64_t)ip_bloom_capacity(fltCfg->ipBloom) * 3)
+    {
+        bloom = copy_ip_bloom(fltCfg->ipBloom);
+        if(bloom == NULL)
+        {
+            free(addrs);
+            free(refs);
+            return false;
+        }
+        for(unsigned int i = 0; i < fltCfg->numAddedIpAddresses; ++i)
+            ip_bloom_add(bloom, fltCfg->addedIpAddresses[i]);
+    }
+
+    release_blocked_ip_addresses(fltCfg);
+    atomic_init(refs, 1);
+    fltCfg->numBlockedIpAddresses = numBlocked;
+    fltCfg->blockedIpAddresses = addrs;
+    fltCfg->ipRefs = refs;
+    fltCfg->numAddedIpAddresses = 0;
+    fltCfg->numRemovedIpAddresses = 0;
+    if(bloom == NULL)
+        return build_ip_bloom(fltCfg);
+    fltCfg->ipBloom = bloom;
+    return true;
+}
+
+
+/// Applies a single incremental change to a filter. The configuration in use
+/// is copied, the change is made to the copy, and the copy is published.
+/// Blocked addresses are changed in short lists that are merged into the
+/// shared sorted array in batches, see merge_due.
+/// @param filter The filter to update
+/// @param add True to add value to the blocked values, false to remove it
+/// @param isPort True if value is a TCP port, false if it is an IP address
+/// @param value The IP address or TCP port
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if value already was (or was not)
+/// blocked, or FILTER_UPDATE_FAILED if memory ran out
+static FilterUpdate update_filter(IpPktFilter filter, bool add, bool isPort,
+                                  unsigned int value)
+{
+    Filter* flt = filter;
+    FilterConfig* oldCfg;
+    FilterConfig* fltCfg;
+    FilterUpdate result = FILTER_UPDATE_FAILED;
+    bool ok;
+
+    pthread_mutex_lock(&flt->updateLock);
+    // only updates hold the lock, so the active configuration is stable here
+    oldCfg = atomic_load(&flt->active);
+    bool present = isPort ? block_inbound_tcp_port(oldCfg, value) :
+                            ip_address_listed(oldCfg, value);
+
+    if(present == add)
+        result = FILTER_UNCHANGED;
+    else if((fltCfg = copy_config(oldCfg)) != NULL)
+    {
+        if(add && isPort)
+        {
+            add_blocked_inbound_tcp_port(fltCfg, value);
+            ok = true;
+        }
+        else if(isPort)
+        {
+            remove_blocked_value(fltCfg->blockedInboundTcpPorts,
+                                 &fltCfg->numBlockedInboundTcpPorts, value);
+            ok = true;
+        }
+        else
+        {
+            ok = change_blocked_ip_address(fltCfg, add, value);
+            if(ok && merge_due(fltCfg))
+                ok = merge_blocked_ip_addresses(fltCfg);
+        }
+
+        if(!ok)
+            destroy_config(fltCfg);
+        else
+        {
+            select_check_variant(fltCfg);
+            build_filter_jit(fltCfg);
+            publish_config(flt, fltCfg);
+            result = FILTER_UPDATED;
+        }
+    }
+    pthread_mutex_unlock(&flt->updateLock);
+    return result;
+}
+
+
+/// Blocks another IP address without reloading the configuration file.
+/// @param filter The filter to update
+/// @param ipAddr The IP address that is to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the address was already
+/// blocked, or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate add_filter_blocked_ip_address(IpPktFilter filter, unsigned int ipAddr)
+{
+    return update_filter(filter, true, false, ipAddr);
+}
+
+
+/// Stops blocking an IP address without reloading the configuration file.
+/// @param filter The filter to update
+/// @param ipAddr The IP address that is no longer to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the address was not blocked,
+/// or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate remove_filter_blocked_ip_address(IpPktFilter filter, unsigned int ipAddr)
+{
+    return update_filter(filter, false, false, ipAddr);
+}
+
+
+/// Blocks another inbound TCP port without reloading the configuration file.
+/// @param filter The filter to update
+/// @param port The TCP port that is to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the port was already blocked,
+/// or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate add_filter_blocked_tcp_port(IpPktFilter filter, unsigned int port)
+{
+    return update_filter(filter, true, true, port);
+}
+
+
+/// Stops blocking an inbound TCP port without reloading the configuration.
+/// @param filter The filter to update
+/// @param port The TCP port that is no longer to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the port was not blocked,
+/// or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate remove_filter_blocked_tcp_port(IpPktFilter filter, unsigned int port)
+{
+    return update_filter(filter, false, true, port);
+}
+
+
+/// Copies the rules of the configuration currently used by the filter. The
+/// rules and both arrays share one allocation.
+/// @param filter The filter whose rules are copied
+/// @return The copy, NULL if memory ran out
+FilterRules* copy_filter_rules(IpPktFilter filter)
+{
+    Filter* flt = filter;
+    FilterRules* rules;
+
+    // holding the lock keeps the configuration from being freed under us
+    pthread_mutex_lock(&flt->updateLock);
+    FilterConfig* fltCfg = atomic_load(&flt->active);
+    size_t portsSize = sizeof(unsigned int) * fltCfg->numBlockedInboundTcpPorts;
+    size_t addrsSize = sizeof(unsigned int) * count_blocked_ip_addresses(fltCfg);
+
+    rules = malloc(sizeof(FilterRules) + portsSize + addrsSize);
+    if(rules == NULL)
+        perror("Error copying filter rules");
+    else
+    {
+        unsigned int* ports = (unsigned int*)(rules + 1);
+        unsigned int* addrs = ports + fltCfg->numBlockedInboundTcpPorts;
+
+        memcpy(ports, fltCfg->blockedInboundTcpPorts, portsSize);
+        list_blocked_ip_addresses(fltCfg, addrs);
+        rules->localIpAddr = fltCfg->localIpAddr;
+        rules->localMask = fltCfg->localMask;
+        rules->blockInboundEchoReq = fltCfg->blockInboundEchoReq;
+        rules->numBlockedInboundTcpPorts = fltCfg->numBlockedInboundTcpPorts;
+        rules->blockedInboundTcpPorts = ports;
+        rules->numBlockedIpAddresses = count_blocked_ip_addresses(fltCfg);
+        rules->blockedIpAddresses = addrs;
+        rules->numBlockedPayloads = fltCfg->payloads != NULL ?
+                                    fltCfg->payloads->numPatterns : 0;
+    }
+    pthread_mutex_unlock(&flt->updateLock);
+    return rules;
+}
+
+
+/// Frees a copy of the rules made by copy_filter_rules.
+/// @param rules The copy to free
+void destroy_filter_rules(FilterRules* rules)
+{
+    free(rules);
+}
+
+
+/// Prints a summary of the configuration currently used by the filter.
+/// @param filter The filter to describe
+/// @param counters False to leave out what was counted while filtering
+/// @param out The stream the summary is printed to
+void print_filter_stats(IpPktFilter filter, bool counters, FILE* out)
+{
+    Filter* flt = filter;
+
+    // holding the lock keeps the configuration from being freed under us
+    pthread_mutex_lock(&flt->updateLock);
+    FilterConfig* fltCfg = atomic_load(&flt->active);
+    fprintf(out, "local net: %u.%u.%u.%u mask %08x\n",
+            fltCfg->localIpAddr >> 24, (fltCfg->localIpAddr >> 16) & 0xff,
+            (fltCfg->localIpAddr >> 8) & 0xff, fltCfg->localIpAddr & 0xff,
+            fltCfg->localMask);
+    fprintf(out, "blocked ip addresses: %u\n", count_blocked_ip_addresses(fltCfg));
+    if(fltCfg->numAddedIpAddresses > 0 || fltCfg->numRemovedIpAddresses > 0)
+        fprintf(out, "not merged yet: %u added, %u removed\n",
+                fltCfg->numAddedIpAddresses, fltCfg->numRemovedIpAddresses);
+    if(fltCfg->ipBloom != NULL)
+    {
+        unsigned long queries = atomic_load(&flt->bloomStats.queries);
+        unsigned long maybeHits = atomic_load(&flt->bloomStats.maybeHits);
+        unsigned long hits = atomic_load(&flt->bloomStats.hits);
+        // false positives out of the lookups for addresses that aren't blocked
+        double fpRate = queries > hits ?
+                        (double)(maybeHits - hits) / (queries - hits) : 0;
+
+        fprintf(out, "bloom filter: %zu bytes for %zu bytes of addresses\n",
+                ip_bloom_size(fltCfg->ipBloom),
+                sizeof(unsigned int) * fltCfg->numBlockedIpAddresses);
+        if(counters)
+            fprintf(out, "bloom lookups: %lu, passed on: %lu, blocked: %lu, "
+                    "false positive rate: %.4f%%\n", queries, maybeHits, hits,
+                    fpRate * 100);
+    }
+    else if(fltCfg->noIpBloom)
+        fputs("bloom filter: none, NO_IP_BLOOM\n", out);
+    fprintf(out, "blocked inbound tcp ports: %u\n",
+            fltCfg->numBlockedInboundTcpPorts);
+    fprintf(out, "block inbound echo requests: %s\n",
+            fltCfg->blockInboundEchoReq ? "yes" : "no");
+    if(fltCfg->genericCheck)
+        fputs("checks: every rule, GENERIC_CHECK\n", out);
+    else
+        fprintf(out, "checks: ip lookup %s, tcp ports %s, echo requests %s\n",
+                ipLookupNames[fltCfg->ipLookup],
+                fltCfg->numBlockedInboundTcpPorts > 0 ? "yes" : "no",
+                fltCfg->blockInboundEchoReq ? "yes" : "no");
+    if(fltCfg->payloads != NULL)
+    {
+        fprintf(out, "blocked payload patterns: %u in %u states, %zu bytes\n",
+                fltCfg->payloads->numPatterns,
+                payload_scanner_states(fltCfg->payloads->scanner),
+                payload_scanner_size(fltCfg->payloads->scanner));
+        if(counters)
+            fprintf(out, "payloads scanned: %lu, blocked: %lu, malformed "
+                    "TCP headers blocked: %lu\n",
+                    atomic_load(&flt->payloadsScanned),
+                    atomic_load(&flt->payloadsBlocked),
+                    atomic_load(&flt->payloadsMalformed));
+    }
+    if(counters)
+    {
+        fprintf(out, "packets blocked cut short: %lu\n",
+                atomic_load(&flt->truncated));
+        print_frag_table_stats(flt->frags, out);
+    }
+    if(fltCfg->jitCompile)
+        fprintf(out, "native code: %s\n", fltCfg->jit != NULL ? "yes" :
+                "no, using the interpreter");
+    if(fltCfg->adaptiveRuleOrder && counters)
+    {
+        unsigned int order = atomic_load(&flt->ruleOrder);
+        fprintf(out, "rule order:");
+        for(int i = 0; i < NUM_RULES; ++i, order >>= RULE_BITS)
+        {
+            FilterRule rule = order & ((1 << RULE_BITS) - 1);
+            fprintf(out, " %s (%lu hits)", ruleNames[rule],
+                    atomic_load(&flt->ruleStats[rule].hits));
+        }
+        fprintf(out, " in %lu sampled packets\n", atomic_load(&flt->numSampled));
+    }
+    pthread_mutex_unlock(&flt->updateLock);
+}
+
+
+/// Checks if a packet ends before the header fields the rules read: the IP
+/// header, then the TCP ports or the ICMP type unless it is a fragment after
+/// the first. Such a packet is blocked just like a first fragment cut short,
+/// and the XDP program does the same, so that neither reads past its end.
+/// @param pkt The packet to examine
+/// @param length The number of bytes received
+/// @return True if the packet is too short for the rules
+static bool packet_truncated(unsigned char* pkt, unsigned int length)
+{
+    if(length < IP_HEADER_LEN)
+        return true;
+    if(IP_FRAG_FIELD(pkt) & IP_FRAG_OFFSET)
+        return false;
+    switch(ExtractIpProtocol(pkt))
+    {
+        case IP_PROTOCOL_TCP:
+            return length < IP_HEADER_LEN + 4;
+        case IP_PROTOCOL_ICMP:
+            return length < IP_HEADER_LEN + 1;
+        default:
+            return false;
+    }
+}
+
+
+/// Determines if a packet is allowed using the configuration the filter is
+/// using right now. The configuration may be replaced by another thread at
+/// any moment; readerSeq is odd for as long as this packet is looking at it
+/// so that the thread replacing it knows when it is safe to free. The
+/// payload is only searched once the header rules have let the packet by.
+/// Fragments after the first of a datagram get the verdict of the first, and
+/// packets too short for the rules are blocked.
+/// @param filter The filter instance to use
+/// @param pkt The packet to examine
+/// @param length The length of the packet in bytes
+/// @return True if the packet is allowed by the filter. False if the packet
+/// is to be blocked
+bool filter_packet(IpPktFilter filter, unsigned char* pkt, unsigned int length)
+{
+    Filter* flt = (Filter*)filter;
+
+    // no configuration is needed to turn away a packet that is cut short
+    if(packet_truncated(pkt, length))
+    {
+        add_count(&flt->truncated, 1);
+        return false;
+    }
+
+    // only one thread filters packets, so nobody else changes readerSeq
+    unsigned int seq = atomic_fetch_add(&flt->readerSeq, 1);
+    FilterConfig* fltCfg = atomic_load(&flt->active);
+    unsigned int fragField = IP_FRAG_FIELD(pkt);
+    bool allowed;
+
+    // a later fragment has no header for the rules to read, its bytes
+    // there are payload that would be taken for ports or an ICMP type
+    if(fragField & IP_FRAG_OFFSET)
+        allowed = frag_table_rest(flt->frags, pkt, length);
+    // compiled code needs no ordering, it checks everything in a few compares
+    else if(fltCfg->jitFn != NULL)
+        allowed = fltCfg->jitFn(pkt);
+    else if(fltCfg->adaptiveRuleOrder)
+        allowed = check_packet_adaptive(flt, fltCfg, pkt);
+    else
+        allowed = fltCfg->checkFn(fltCfg, pkt);
+    if(allowed && fltCfg->payloads != NULL)
+        allowed = !block_payload(flt, fltCfg, pkt, length);
+    if((fragField & (IP_FRAG_MORE | IP_FRAG_OFFSET)) == IP_FRAG_MORE)
+        allowed = frag_table_first(flt->frags, pkt, length, allowed);
+
+    atomic_store_explicit(&flt->readerSeq, seq + 2, memory_order_release);
+    return allowed;
+}
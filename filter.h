@@ -7,12 +7,38 @@
 #define __FILTER_H__
 
 #include <stdbool.h>
+#include <stdio.h>
 
 
 /// The type used by the client to store/use a filter instance
 typedef void* IpPktFilter;
 
 
+/// The settings of a filter configuration that decide what is blocked, for
+/// building other filters that give the same verdicts. Addresses are sorted.
+typedef struct FilterRules_S
+{
+    unsigned int localIpAddr;                  ///< the local IP address
+    unsigned int localMask;                    ///< the address mask
+    bool blockInboundEchoReq;                  ///< block inbound echo requests
+    unsigned int numBlockedInboundTcpPorts;    ///< count of blocked ports
+    const unsigned int* blockedInboundTcpPorts;///< array of blocked ports
+    unsigned int numBlockedIpAddresses;        ///< count of blocked addresses
+    const unsigned int* blockedIpAddresses;    ///< array of blocked addresses
+    unsigned int numBlockedPayloads;           ///< count of payload patterns
+} FilterRules;
+
+
+/// The outcome of an incremental update of a filter instance
+typedef enum FilterUpdate_E
+{
+    FILTER_UPDATED,                            ///< the change was made
+    FILTER_UNCHANGED,                          ///< it was already that way
+    FILTER_UPDATE_FAILED                       ///< memory ran out; the old
+                                               ///< settings are kept
+} FilterUpdate;
+
+
 /// Creates and instance of a IP packet filter
 /// @return A pointer to the new instance
 IpPktFilter create_filter(void);
@@ -24,20 +50,96 @@ IpPktFilter create_filter(void);
 void destroy_filter(IpPktFilter filter);
 
 
-/// Configures a newly created filter instance based on the settings
-/// in the provided configuration file
+/// Configures a filter instance based on the settings in the provided
+/// configuration file. May be called again to reload the settings while
+/// another thread is filtering packets; on failure the old ones are kept.
 /// @param filter The filter instance that is to be configured
 /// @param filename The path/filename of the configuration file
 /// @return True if successful
 bool configure_filter(IpPktFilter filter, char* filename);
 
 
+/// Blocks another IP address in a configured filter instance. Safe to call
+/// while another thread is filtering packets.
+/// @param filter The filter instance that is to be updated
+/// @param ipAddr The IP address that is to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the address was already
+/// blocked, or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate add_filter_blocked_ip_address(IpPktFilter filter, unsigned int ipAddr);
+
+
+/// Stops blocking an IP address in a configured filter instance. Safe to
+/// call while another thread is filtering packets.
+/// @param filter The filter instance that is to be updated
+/// @param ipAddr The IP address that is no longer to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the address was not blocked,
+/// or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate remove_filter_blocked_ip_address(IpPktFilter filter, unsigned int ipAddr);
+
+
+/// Blocks another inbound TCP port in a configured filter instance. Safe to
+/// call while another thread is filtering packets.
+/// @param filter The filter instance that is to be updated
+/// @param port The TCP port that is to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the port was already blocked,
+/// or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate add_filter_blocked_tcp_port(IpPktFilter filter, unsigned int port);
+
+
+/// Stops blocking an inbound TCP port in a configured filter instance. Safe
+/// to call while another thread is filtering packets.
+/// @param filter The filter instance that is to be updated
+/// @param port The TCP port that is no longer to be blocked
+/// @return FILTER_UPDATED, FILTER_UNCHANGED if the port was not blocked,
+/// or FILTER_UPDATE_FAILED if memory ran out
+FilterUpdate remove_filter_blocked_tcp_port(IpPktFilter filter, unsigned int port);
+
+
+/// Recomputes the order in which a filter instance checks its rules from
+/// the hit statistics gathered since the last call. Does nothing unless the
+/// configuration file set ADAPTIVE_RULE_ORDER. Safe to call while another
+/// thread is filtering packets.
+/// @param filter The filter instance whose rules are to be reordered
+void reorder_filter_rules(IpPktFilter filter);
+
+
+/// Checks if the configuration a filter instance is using set
+/// ADAPTIVE_RULE_ORDER, so that reorder_filter_rules has work to do.
+/// @param filter The filter instance to check
+/// @return True if its rules are to be reordered
+bool filter_adapts_rule_order(IpPktFilter filter);
+
+
+/// Copies the rules a filter instance is using right now. Safe to call
+/// while another thread is filtering packets.
+/// @param filter The filter instance whose rules are copied
+/// @return The copy, NULL if memory ran out
+FilterRules* copy_filter_rules(IpPktFilter filter);
+
+
+/// Frees a copy made by copy_filter_rules.
+/// @param rules The copy that is to be freed
+void destroy_filter_rules(FilterRules* rules);
+
+
+/// Prints a summary of the settings of a filter instance, and what it
+/// counted while filtering packets
+/// @param filter The filter instance that is to be described
+/// @param counters False to print only the settings, as when the packets
+/// are filtered elsewhere
+/// @param out The stream to print the summary to
+void print_filter_stats(IpPktFilter filter, bool counters, FILE* out);
+
+
 /// Determines if an IP packet is allowed or if it should be blocked
-/// based on the settings in the specified filter instance
+/// based on the settings in the specified filter instance. Only one
+/// thread at a time may filter packets with a filter instance. The later
+/// fragments of a fragmented datagram get the verdict of its first one.
 /// @param filter The filter instance that is to be used
 /// @param pkt The IP packet that is to be evaluated
+/// @param length The length of the packet in bytes
 /// @return True if the packet is allowed, False if it should be blocked
-bool filter_packet(IpPktFilter filter, unsigned char* pkt);
+bool filter_packet(IpPktFilter filter, unsigned char* pkt, unsigned int length);
 
 #endif
 
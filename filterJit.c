@@ -0,0 +1,317 @@
+/// \file filterJit.c
+/// \brief Compiles a small filter configuration into native x86-64 code
+/// with every setting baked in as a constant.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+///
+/// The generated function follows the System V calling convention: the
+/// packet pointer arrives in rdi and the verdict is returned in eax. It reads
+/// the header fields at the same fixed offsets pktUtility uses for a standard
+/// 20 byte IP header, then runs a straight line of compares:
+///
+///     src = bswap [pkt+12], dst = bswap [pkt+16]
+///     for each blocked address: src == addr or dst == addr -> block
+///     if dst is local and src is not:
+///         protocol [pkt+9] ICMP and type [pkt+20] echo request -> block
+///         protocol TCP and port [pkt+22] a blocked port         -> block
+///     allow
+
+/// needed for MAP_ANONYMOUS
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "filterJit.h"
+#include "pktUtility.h"
+
+/// bytes of code outside the compare chains
+#define JIT_FIXED_CODE 128
+
+/// bytes of code for each blocked address, two compares and two jumps
+#define JIT_ADDR_CODE 23
+
+/// bytes of code for each blocked port, a compare and a jump
+#define JIT_PORT_CODE 12
+
+/// most jumps whose targets are filled in after the code is laid out
+#define JIT_MAX_FIXUPS (2 * JIT_MAX_RULES + JIT_MAX_RULES + 8)
+
+/// The places a generated jump can go
+typedef enum JitLabel_E
+{
+    LABEL_ALLOW,                               ///< return true
+    LABEL_BLOCK,                               ///< return false
+    LABEL_NOT_ICMP,                            ///< past the ICMP check
+    NUM_LABELS
+} JitLabel;
+
+/// The type used to hold the code while it is generated
+typedef struct JitBuffer_S
+{
+    unsigned char* code;                       ///< the code so far
+    size_t len;                                ///< bytes of code so far
+    size_t labels[NUM_LABELS];                 ///< offset of each label
+    size_t fixups[JIT_MAX_FIXUPS];             ///< offsets of rel32 fields
+    JitLabel fixupLabels[JIT_MAX_FIXUPS];      ///< label each one jumps to
+    unsigned int numFixups;                    ///< number of fixups
+} JitBuffer;
+
+/// The type used to hold a compiled filter
+typedef struct Jit_S
+{
+    void* mem;                                 ///< the mapped code page(s)
+    size_t size;                               ///< size of the mapping
+    JitFilterFn fn;                            ///< entry point of the code
+} Jit;
+
+
+/// Appends bytes of code.
+/// @param buf The code buffer
+/// @param bytes The bytes to append
+/// @param len The number of bytes
+static void emit(JitBuffer* buf, const unsigned char* bytes, size_t len)
+{
+    memcpy(buf->code + buf->len, bytes, len);
+    buf->len += len;
+}
+
+
+/// Appends a 32 bit little endian immediate.
+/// @param buf The code buffer
+/// @param value The immediate
+static void emit_imm32(JitBuffer* buf, uint32_t value)
+{
+    unsigned char bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    emit(buf, bytes, 4);
+}
+
+
+/// Appends a jump opcode followed by a rel32 that is filled in later.
+/// @param buf The code buffer
+/// @param opcode The opcode bytes, e.g. 0F 84 for je
+/// @param len The number of opcode bytes
+/// @param label Where the jump goes
+static void emit_jump(JitBuffer* buf, const unsigned char* opcode, size_t len,
+                      JitLabel label)
+{
+    emit(buf, opcode, len);
+    buf->fixups[buf->numFixups] = buf->len;
+    buf->fixupLabels[buf->numFixups++] = label;
+    emit_imm32(buf, 0);
+}
+
+
+/// Appends je label.
+/// @param buf The code buffer
+/// @param label Where the jump goes
+static void emit_je(JitBuffer* buf, JitLabel label)
+{
+    static const unsigned char je[] = { 0x0f, 0x84 };
+    emit_jump(buf, je, sizeof(je), label);
+}
+
+
+/// Appends jne label.
+/// @param buf The code buffer
+/// @param label Where the jump goes
+static void emit_jne(JitBuffer* buf, JitLabel label)
+{
+    static const unsigned char jne[] = { 0x0f, 0x85 };
+    emit_jump(buf, jne, sizeof(jne), label);
+}
+
+
+/// Appends the inbound check: falls through only if the destination (edx)
+/// is on the local network and the source (eax) is not.
+/// @param buf The code buffer
+/// @param rules The rules being compiled
+static void emit_inbound_check(JitBuffer* buf, const FilterRules* rules)
+{
+    static const unsigned char movEcxEdx[] = { 0x89, 0xd1 };
+    static const unsigned char movEcxEax[] = { 0x89, 0xc1 };
+    static const unsigned char andEcx[] = { 0x81, 0xe1 };
+    static const unsigned char cmpEcx[] = { 0x81, 0xf9 };
+    uint32_t localMasked = rules->localIpAddr & rules->localMask;
+
+    emit(buf, movEcxEdx, sizeof(movEcxEdx));
+    emit(buf, andEcx, sizeof(andEcx));
+    emit_imm32(buf, rules->localMask);
+    emit(buf, cmpEcx, sizeof(cmpEcx));
+    emit_imm32(buf, localMasked);
+    emit_jne(buf, LABEL_ALLOW);
+
+    emit(buf, movEcxEax, sizeof(movEcxEax));
+    emit(buf, andEcx, sizeof(andEcx));
+    emit_imm32(buf, rules->localMask);
+    emit(buf, cmpEcx, sizeof(cmpEcx));
+    emit_imm32(buf, localMasked);
+    emit_je(buf, LABEL_ALLOW);
+}
+
+
+/// Generates the code for a set of rules into a buffer.
+/// @param buf The code buffer, large enough for the rules
+/// @param rules The rules to compile
+static void generate(JitBuffer* buf, const FilterRules* rules)
+{
+    // mov eax, [rdi+12]; bswap eax; mov edx, [rdi+16]; bswap edx
+    static const unsigned char loadAddrs[] =
+        { 0x8b, 0x47, 0x0c, 0x0f, 0xc8, 0x8b, 0x57, 0x10, 0x0f, 0xca };
+    static const unsigned char cmpEax[] = { 0x3d };
+    static const unsigned char cmpEdx[] = { 0x81, 0xfa };
+    // movzx ecx, byte [rdi+9]
+    static const unsigned char loadProtocol[] = { 0x0f, 0xb6, 0x4f, 0x09 };
+    // cmp ecx, ICMP
+    static const unsigned char cmpIcmp[] = { 0x83, 0xf9, IP_PROTOCOL_ICMP };
+    // cmp byte [rdi+20], echo request
+    static const unsigned char cmpEchoReq[] = { 0x80, 0x7f, 0x14, ICMP_TYPE_ECHO_REQ };
+    static const unsigned char jmp[] = { 0xe9 };
+    // cmp ecx, TCP
+    static const unsigned char cmpTcp[] = { 0x83, 0xf9, IP_PROTOCOL_TCP };
+    // movzx ecx, word [rdi+22]; rol cx, 8
+    static const unsigned char loadPort[] =
+        { 0x0f, 0xb7, 0x4f, 0x16, 0x66, 0xc1, 0xc1, 0x08 };
+    static const unsigned char cmpEcx[] = { 0x81, 0xf9 };
+    // mov eax, 1; ret
+    static const unsigned char retTrue[] = { 0xb8, 0x01, 0x00, 0x00, 0x00, 0xc3 };
+    // xor eax, eax; ret
+    static const unsigned char retFalse[] = { 0x31, 0xc0, 0xc3 };
+
+    emit(buf, loadAddrs, sizeof(loadAddrs));
+    for(unsigned int i = 0; i < rules->numBlockedIpAddresses; ++i)
+    {
+        emit(buf, cmpEax, sizeof(cmpEax));
+        emit_imm32(buf, rules->blockedIpAddresses[i]);
+        emit_je(buf, LABEL_BLOCK);
+        emit(buf, cmpEdx, sizeof(cmpEdx));
+        emit_imm32(buf, rules->blockedIpAddresses[i]);
+        emit_je(buf, LABEL_BLOCK);
+    }
+
+    // the protocol rules, which only look at inbound packets
+    if(rules->blockInboundEchoReq || rules->numBlockedInboundTcpPorts > 0)
+    {
+        emit_inbound_check(buf, rules);
+        emit(buf, loadProtocol, sizeof(loadProtocol));
+        if(rules->blockInboundEchoReq)
+        {
+            emit(buf, cmpIcmp, sizeof(cmpIcmp));
+            emit_jne(buf, LABEL_NOT_ICMP);
+            emit(buf, cmpEchoReq, sizeof(cmpEchoReq));
+            emit_je(buf, LABEL_BLOCK);
+            emit_jump(buf, jmp, sizeof(jmp), LABEL_ALLOW);
+        }
+        buf->labels[LABEL_NOT_ICMP] = buf->len;
+        if(rules->numBlockedInboundTcpPorts > 0)
+        {
+            emit(buf, cmpTcp, sizeof(cmpTcp));
+            emit_jne(buf, LABEL_ALLOW);
+            emit(buf, loadPort, sizeof(loadPort));
+            for(unsigned int i = 0; i < rules->numBlockedInboundTcpPorts; ++i)
+            {
+                emit(buf, cmpEcx, sizeof(cmpEcx));
+                emit_imm32(buf, rules->blockedInboundTcpPorts[i]);
+                emit_je(buf, LABEL_BLOCK);
+            }
+        }
+    }
+
+    buf->labels[LABEL_ALLOW] = buf->len;
+    emit(buf, retTrue, sizeof(retTrue));
+    buf->labels[LABEL_BLOCK] = buf->len;
+    emit(buf, retFalse, sizeof(retFalse));
+
+    // every jump is relative to the end of its rel32 field
+    for(unsigned int i = 0; i < buf->numFixups; ++i)
+    {
+        int32_t rel = (int32_t)(buf->labels[buf->fixupLabels[i]] -
+                                (buf->fixups[i] + 4));
+        size_t end = buf->len;
+        buf->len = buf->fixups[i];
+        emit_imm32(buf, (uint32_t)rel);
+        buf->len = end;
+    }
+}
+
+
+/// Creates a compiled filter by generating its code into a buffer, then
+/// copying it into a fresh mapping that is made executable and read only.
+/// @param rules The rules to compile
+/// @return A pointer to the new compiled filter, NULL on failure
+FilterJit create_filter_jit(const FilterRules* rules)
+{
+#if defined(__x86_64__)
+    JitBuffer buf;
+    Jit* jit;
+    size_t capacity;
+
+    if(rules->numBlockedIpAddresses > JIT_MAX_RULES ||
+       rules->numBlockedInboundTcpPorts > JIT_MAX_RULES)
+        return NULL;
+
+    capacity = JIT_FIXED_CODE + JIT_ADDR_CODE * rules->numBlockedIpAddresses +
+               JIT_PORT_CODE * rules->numBlockedInboundTcpPorts;
+    buf.code = malloc(capacity);
+    jit = malloc(sizeof(Jit));
+    if(buf.code == NULL || jit == NULL)
+    {
+        perror("Error compiling filter");
+        free(buf.code);
+        free(jit);
+        return NULL;
+    }
+    buf.len = 0;
+    buf.numFixups = 0;
+    generate(&buf, rules);
+
+    // the page is never writable and executable at the same time
+    jit->size = buf.len;
+    jit->mem = mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->mem == MAP_FAILED)
+    {
+        perror("Error compiling filter");
+        free(buf.code);
+        free(jit);
+        return NULL;
+    }
+    memcpy(jit->mem, buf.code, buf.len);
+    free(buf.code);
+    if(mprotect(jit->mem, jit->size, PROT_READ | PROT_EXEC) == -1)
+    {
+        perror("Error compiling filter");
+        munmap(jit->mem, jit->size);
+        free(jit);
+        return NULL;
+    }
+
+    // ISO C has no cast from object to function pointer, so copy the bits
+    memcpy(&jit->fn, &jit->mem, sizeof(jit->fn));
+    return (FilterJit) jit;
+#else
+    (void)rules;
+    return NULL;
+#endif
+}
+
+
+/// Destroys a compiled filter by unmapping its code and freeing it.
+/// @param jit The compiled filter that is to be destroyed
+void destroy_filter_jit(FilterJit jit)
+{
+    Jit* pJit = jit;
+
+    munmap(pJit->mem, pJit->size);
+    free(pJit);
+}
+
+
+/// Gets the entry point of a compiled filter.
+/// @param jit The compiled filter
+/// @return The function to call for each packet
+JitFilterFn filter_jit_function(FilterJit jit)
+{
+    return ((Jit*)jit)->fn;
+}
@@ -0,0 +1,46 @@
+/// \file filterJit.h
+/// \brief Compiles a small filter configuration into native x86-64 code
+/// with every setting baked in as a constant.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __FILTER_JIT_H__
+#define __FILTER_JIT_H__
+
+#include <stdbool.h>
+#include "filter.h"
+
+/// most blocked IP addresses, and most blocked TCP ports, that are compiled;
+/// past this the compiled compare chain is no faster than a table lookup
+#define JIT_MAX_RULES 64
+
+
+/// The type of a compiled filter. Behaves exactly like filter_packet with
+/// the configuration it was compiled from.
+/// @param pkt The IP packet that is to be evaluated
+/// @return True if the packet is allowed, False if it should be blocked
+typedef bool (*JitFilterFn)(unsigned char* pkt);
+
+
+/// The type used by the client to store/use a compiled filter
+typedef void* FilterJit;
+
+
+/// Compiles a set of filter rules into native code in a page that is
+/// writable while the code is written and only executable afterwards.
+/// @param rules The rules to compile
+/// @return A pointer to the new instance, NULL if the rules are too large,
+/// the machine is not x86-64 or the code page could not be set up
+FilterJit create_filter_jit(const FilterRules* rules);
+
+
+/// Destroys a compiled filter and unmaps its code.
+/// @param jit The instance to destroy
+void destroy_filter_jit(FilterJit jit);
+
+
+/// Gets the native function of a compiled filter.
+/// @param jit The compiled filter
+/// @return The function to call for each packet
+JitFilterFn filter_jit_function(FilterJit jit);
+
+#endif
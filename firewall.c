@@ -12,24 +12,56 @@
 /// Rochester Institute of Technology Computer Science department.
 /// The content of this file is protected as an unpublished work.
 
-/// posix needed for signal handling
-#define _POSIX_SOURCE
+/// posix needed for signal handling and getopt
+#define _POSIX_C_SOURCE 200809L
 
+#include <sys/socket.h>   /* control socket stuff is from here */
+#include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>      /* interrupt signal stuff is from here */
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>      /* read library call comes from here */
 #include "filter.h"
+#include "perfCounters.h"
+#include "pktTap.h"
+#include "statCount.h"
+#include "xdpFilter.h"
 
 /// maximum packet length (ipv4)
 #define MAX_PKT_LENGTH 2048
 
+/// maximum length of a line sent to the control socket
+#define MAX_CMD_LEN 128
+
+/// number of control socket connections that may wait to be accepted
+#define CONTROL_BACKLOG 4
+
+/// number of control socket clients served at once
+#define MAX_CONTROL_CLIENTS 16
+
+/// milliseconds a reply may wait for a control client to make room for it
+#define CONTROL_SEND_TIMEOUT_MS 1000
+
+/// milliseconds a draining filter thread waits for the rest of a packet
+#define DRAIN_TIMEOUT_MS 1000
+
+/// milliseconds between updates of the order the filter checks rules in
+#define ADAPT_INTERVAL_MS 1000
+
+/// getopt_long value of --perf, which has no short option
+#define OPT_PERF 256
+
 /// Type used to control the mode of the firewall
 typedef enum FilterMode_E
 {
@@ -43,14 +75,15 @@ enum RunMode_e{
     EXIT,
     BLOCK,
     ALLOW,
-    FILTER
+    FILTER,
+    PERF
 };
 
 
 /// Pipes_S structure maintains the stream pointers.
 typedef struct Pipes_S
 {
-    FILE * in_pipe;                  ///< input pipe stream
+    FILE * in_pipe;                  ///< input pipe stream, read unbuffered
     FILE * out_pipe;                 ///< output pipe stream
 } Pipes_T;
 
@@ -60,24 +93,76 @@ typedef struct FWSpec_S
     char * config_file;              ///< name of the firewall config file
     char * in_file;                  ///< name of input pipe
     char * out_file;                 ///< name of output pipe
+    char * control_file;             ///< name of the control socket, or NULL
+    char * tap_file;                 ///< name of the tap output, or NULL
+    char * xdp_ifname;               ///< interface to filter with XDP, or NULL
+    TapSelect tap_select;            ///< which packets the tap mirrors
+    unsigned int tap_rate;           ///< tap mirrors 1 in tap_rate packets
+    bool drain;                      ///< finish queued packets on exit
+    bool count_perf;                 ///< count hardware events per stage
     IpPktFilter filter;              ///< pointer to the filter configuration
+    PktTap tap;                      ///< the packet tap, or NULL if unused
+    PerfCounters perf;               ///< the filter thread's counters, or NULL
+    XdpFilter xdp;                   ///< the XDP program, or NULL if unused
     Pipes_T pipes;                   ///< pipes is the stream data storage.
+    int control_fd;                  ///< listening control socket, or -1
+    atomic_ulong num_allowed;        ///< packets passed on by the filter thread
+    atomic_ulong num_blocked;        ///< packets dropped by the filter thread
 } FWSpec_T;
 
 /// fw_spec is the specification data storage for the firewall.
 static FWSpec_T fw_spec;
 
-/// MODE controls the mode of the firewall. main writes it and filter reads it.
-static volatile FilterMode MODE = MODE_FILTER;
+/// MODE controls the mode of the firewall. main and the control thread write
+/// it and filter reads it. Nothing else is published along with a mode change,
+/// so every access is relaxed.
+static atomic_int MODE = MODE_FILTER;
+
+/// the XDP program mode for each firewall mode
+static const XdpMode xdp_modes[] =
+{
+    [MODE_BLOCK_ALL] = XDP_MODE_BLOCK_ALL,
+    [MODE_ALLOW_ALL] = XDP_MODE_ALLOW_ALL,
+    [MODE_FILTER] = XDP_MODE_FILTER
+};
+
+/// NOT_CANCELLED flag cleared by request_shutdown and read by every thread.
+static atomic_bool NOT_CANCELLED = true;
+
+/// HANGUP is set by the signal handler so main can report the hangup.
+static volatile sig_atomic_t HANGUP = 0;
 
-/// NOT_CANCELLED flag written by main and read by the thread.
-static volatile int NOT_CANCELLED = 1;
+/// self pipe written once by request_shutdown. It is never read, so once
+/// shutdown is requested it stays readable and wakes every poll that has it.
+static int wake_pipe[2] = { -1, -1 };
 
 /// thread object for the filter thread
 static pthread_t tid_filter;
 
-/// thread specific data key for pthread cleanup after cancellation.
-static pthread_key_t tsd_key;
+/// thread object for the control socket thread
+static pthread_t tid_control;
+
+/// thread object for the thread that reorders the filter rules
+static pthread_t tid_adapt;
+
+/// set once the thread that reorders the filter rules has been started
+static bool adapt_started = false;
+
+
+/// LineReader_S structure splits a file descriptor into lines of text.
+typedef struct LineReader_S
+{
+    int fd;                          ///< descriptor the lines come from
+    size_t len;                      ///< number of bytes held in buf
+    char buf[MAX_CMD_LEN];           ///< bytes read but not yet returned
+} LineReader_T;
+
+/// ControlClient_S structure is one connection to the control socket.
+typedef struct ControlClient_S
+{
+    LineReader_T reader;             ///< splits the commands into lines
+    FILE * out;                      ///< stream the replies are written to
+} ControlClient_T;
 
 
 /// Open the input and output streams used for reading and writing packets.
@@ -119,37 +204,138 @@ void close_pipes(Pipes_T *pipetab) {
 }
 
 
-/// The tsd_destroy function cleans up thread specific data (TSD).
-/// The spawning thread passes this function into pthread_key_create before
-/// starting the thread.
-/// The thread instance calls pthread_setspecific(key, (void *) value)
-/// where value is the dynamic thread specific data.
-/// When the thread exits, infrastructure calls the destroy function to
-/// dispose of the TSD.
-/// @param tsd_data pointer to thread specific data allocations to free/close
-void tsd_destroy(void * tsd_data) {
+/// The filter_thread_cleanup function releases what the filter thread owns
+/// once it has stopped handling packets: the tap and the pipes.
+/// @param data pointer to the FWSpec_T the thread was started with
+static void filter_thread_cleanup(void * data) {
 
-    FWSpec_T *fw_spec = (FWSpec_T *)tsd_data;
-    puts("fw: thread destructor is deleting filter data.");
-    if (fw_spec->filter)
+    FWSpec_T *fw_spec = (FWSpec_T *)data;
+    // the filter itself belongs to main, the control thread may still use it
+    if (fw_spec->tap)
     {
-        destroy_filter(fw_spec->filter);
-        fw_spec->filter = NULL;
+        puts("fw: thread is stopping the tap.");
+        destroy_tap(fw_spec->tap);
+        fw_spec->tap = NULL;
     }
-    puts("fw: thread destructor is closing pipes.");
+    puts("fw: thread is closing pipes.");
     close_pipes(&fw_spec->pipes);
 }
 
 
-/// signal handler passes signal information to the subordinate thread so
-/// that the thread can gracefully terminate and clean up.
+/// Asks every thread to finish up. Only uses async signal safe operations so
+/// that the signal handler can call it too.
+static void request_shutdown(void)
+{
+    // keeps errno intact for whatever the signal interrupted
+    int saved_errno = errno;
+
+    atomic_store(&NOT_CANCELLED, false);
+    if(write(wake_pipe[1], "", 1) == -1)
+    {
+        // the pipe is already full of wakeups, which is just as good
+    }
+    errno = saved_errno;
+}
+
+
+/// signal handler passes signal information to the threads so that they can
+/// gracefully terminate and clean up.
 /// @param signum signal that was received by the main thread.
 static void sig_handler(int signum)
 {
     if (signum == SIGHUP) {
-        NOT_CANCELLED = 0;
-        puts("\nfw: received Hangup request. Cancelling...");
-        pthread_cancel(tid_filter);                // cancel on signal to hangup
+        HANGUP = 1;
+        request_shutdown();                        // wake everyone on hangup
+    }
+}
+
+
+/// Creates the self pipe used to wake blocked threads for shutdown.
+/// @return true if successful
+static bool open_wake_pipe(void)
+{
+    if(pipe(wake_pipe) == -1)
+    {
+        perror("fw: ERROR: failed to create wake pipe");
+        return false;
+    }
+    // the signal handler must never block writing to it
+    fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+
+/// Waits until a file descriptor is readable or shutdown is requested.
+/// @param fd The descriptor to wait for
+/// @param timeout_ms How long to wait, -1 for ever
+/// @return 1 if fd is readable, 0 if shutdown was requested or the timeout
+/// passed, -1 for error
+static int wait_readable(int fd, int timeout_ms)
+{
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+    int ready;
+
+    do
+        ready = poll(fds, 2, timeout_ms);
+    while(ready == -1 && errno == EINTR);
+
+    if(ready == -1)
+        return -1;
+    // data still waiting on fd is served first, shutdown only when it is idle
+    if(fds[0].revents != 0)
+        return 1;
+    return 0;
+}
+
+
+/// Takes the next line of text out of what a line reader has read so far.
+/// A line longer than the buffer is returned in pieces.
+/// @param reader The line reader to use
+/// @param line Destination for the line without its newline, at least
+/// MAX_CMD_LEN bytes long
+/// @return true for a line, false if no whole line has been read yet
+static bool take_line(LineReader_T *reader, char *line)
+{
+    char *newline = memchr(reader->buf, '\n', reader->len);
+    if(newline == NULL && reader->len < MAX_CMD_LEN - 1)
+        return false;
+
+    size_t len = newline != NULL ? (size_t)(newline - reader->buf) : reader->len;
+    memcpy(line, reader->buf, len);
+    line[len] = '\0';
+    // drops the newline too, if there was one
+    len += newline != NULL;
+    reader->len -= len;
+    memmove(reader->buf, reader->buf + len, reader->len);
+    return true;
+}
+
+
+/// Reads the next line of text from a line reader. A line longer than the
+/// buffer is returned in pieces.
+/// @param reader The line reader to use
+/// @param line Destination for the line without its newline, at least
+/// MAX_CMD_LEN bytes long
+/// @return 1 for a line, 0 if shutdown was requested, -1 at end of input
+static int read_line(LineReader_T *reader, char *line)
+{
+    while(true)
+    {
+        if(take_line(reader, line))
+            return 1;
+
+        int ready = wait_readable(reader->fd, -1);
+        if(ready != 1)
+            return ready;
+        if(!atomic_load_explicit(&NOT_CANCELLED, memory_order_relaxed))
+            return 0;
+        ssize_t numRead = read(reader->fd, reader->buf + reader->len,
+                               MAX_CMD_LEN - 1 - reader->len);
+        if(numRead == -1 && errno == EINTR)
+            continue;
+        if(numRead <= 0)
+            return -1;
+        reader->len += numRead;
     }
 }
 
@@ -164,43 +350,124 @@ static void init_sig_handlers()
     signal_action.sa_handler = sig_handler;       // insert handler function
 
     sigaction(SIGHUP, &signal_action, NULL);      // for HangUP from fwSim
+
+    // a reader of a pipe going away shows up as EPIPE from the write instead
+    // of killing the firewall
+    signal_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &signal_action, NULL);
     return;
 } // init_sig_handlers
 
 
+/// Reads exactly len bytes from the input pipe unless shutdown is requested
+/// first. Once shutdown is requested a draining reader keeps going for as
+/// long as data is waiting, and finishes a packet it has started as long as
+/// the rest shows up within DRAIN_TIMEOUT_MS.
+/// @param fd the input pipe descriptor
+/// @param buf Destination buffer
+/// @param len The number of bytes to read
+/// @param drain true to keep reading queued data after shutdown
+/// @param started true if part of the packet has already been read
+/// @return number of bytes read, which is less than len only at end of
+/// input or for shutdown, or -1 with errno set if the pipe could not be read
+static ssize_t read_fully(int fd, void *buf, size_t len, bool drain, bool started)
+{
+    size_t total = 0;
+
+    while(total < len)
+    {
+        if(!atomic_load_explicit(&NOT_CANCELLED, memory_order_relaxed))
+        {
+            // an idle pipe, or not draining at all, means we are done
+            if(!drain || wait_readable(fd, started || total > 0 ?
+                                       DRAIN_TIMEOUT_MS : 0) != 1)
+                break;
+        }
+        else
+        {
+            int ready = wait_readable(fd, -1);
+            if(ready == -1)
+                return -1;
+            // woken for shutdown, which is handled at the top of the loop
+            if(ready == 0)
+                continue;
+        }
+
+        ssize_t numRead = read(fd, (char *)buf + total, len - total);
+        if(numRead == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(numRead == -1)
+            return -1;
+        // zero bytes means the writer closed the pipe
+        if(numRead == 0)
+            break;
+        total += numRead;
+    }
+    return total;
+}
+
+
 /// Read an entire IP packet from the input pipe
-/// @param in_pipe the binary input file stream
+/// @param spec_ptr the firewall specification holding the input pipe
 /// @param buf Destination buffer for storing the packet
 /// @param buflen The length of the supplied destination buffer
-/// @return length of the packet or -1 for error
-static int read_packet(FILE * in_pipe, unsigned char* buf, int buflen)
+/// @return length of the packet, 0 if shutdown came first or the input
+/// ended between packets, or -1 for error
+static int read_packet(FWSpec_T *spec_ptr, unsigned char* buf, int buflen)
 {
+    int fd = fileno(spec_ptr->pipes.in_pipe);
     // the number of bytes the packet is as well as the number of bytes read
     int numBytes = 0, numRead = 0;
+    ssize_t sizeRead;
     // reads in the number of bytes we should read in
-    if(fread(&numBytes, sizeof(int), 1, in_pipe) != 1)
+    sizeRead = read_fully(fd, &numBytes, sizeof(int), spec_ptr->drain, false);
+    if(sizeRead == -1)
     {
-        fprintf(stderr, "fw: ERROR: error reading packet size.\n");
+        fprintf(stderr, "fw: ERROR: failed to read packet size: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    if(sizeRead == 0)
+    {
+        // the writer closing the pipe between packets is a normal end
+        if(atomic_load(&NOT_CANCELLED))
+            puts("fw: end of input.");
+        return 0;
+    }
+    if(sizeRead != (ssize_t)sizeof(int))
+    {
+        fprintf(stderr, "fw: ERROR: input ended inside a packet size.\n");
         return -1;
     }
 
+    // a length that is not positive means the stream is out of step
+    if(numBytes <= 0)
+    {
+        fprintf(stderr, "fw: ERROR: bad packet size %d.\n", numBytes);
+        return -1;
+    }
     // if the number of bytes for this packet is too large, we need to abort
     if(numBytes > buflen)
     {
         // alerts that an incoming packet is too big
-        fprintf(stderr, "fw: ERROR: packet is too large.\n");
+        fprintf(stderr, "fw: ERROR: packet is too large (%d bytes).\n", numBytes);
         //return -1 as failure
         return -1;
     }
 
     /* reads in the number of bytes specified in numBytes
-       NOTE: this reads in a single byte, numBytes time (so when -b in fwSim
-       is used, the fread will read all of the possible bytes) */
-    numRead = fread(buf, sizeof(unsigned char), numBytes, in_pipe);
+       NOTE: this keeps reading until all of them are in (so when -b in fwSim
+       is used, the read will read all of the possible bytes) */
+    numRead = read_fully(fd, buf, numBytes, spec_ptr->drain, true);
     // returns -1 if something went wrong, otherwise the number of bytes read in
+    if(numRead == -1)
+    {
+        fprintf(stderr, "fw: ERROR: failed to read packet: %s\n", strerror(errno));
+        return -1;
+    }
     if(numBytes != numRead)
     {
-        // prints that something went wrong
+        // the input ended, or shutdown gave up waiting for the rest
         fprintf(stderr, "fw: ERROR: numBytes != numRead (%d != %d).\n", numBytes, numRead);
         // returns -1
         return -1;
@@ -212,33 +479,47 @@ static int read_packet(FILE * in_pipe, unsigned char* buf, int buflen)
 
 /// Runs as a thread and handles each packet. It is responsible
 /// for reading each packet in its entirety from the input pipe,
-/// filtering it, and then writing it to the output pipe. The
+/// filtering it, and then writing it to the output pipe. A packet that has
+/// been read is always written out before the thread looks at shutdown, and
+/// in drain mode every packet already queued in the input pipe is too. The
 /// single void* parameter matches what is expected by pthread.
 /// return value and parameter must match those expected by pthread_create.
 /// @param args pointer to an FWSpec_T structure
 /// @return pointer to static exit status value which is 0 on success
 static void * filter_thread(void* args)
 {
-    // sets the tsd specific destructor (to delete the thread stuff)
-    pthread_setspecific(tsd_key, args);
-
     // our firewall specification (need to case since it is void)
     FWSpec_T * spec_p = (FWSpec_T *) args;
     // a few variables needed for running
     unsigned char pktBuf[MAX_PKT_LENGTH];
     // used to store the length of the read packet
     int length;
+    // whether or not the current packet is let through
+    bool allowed;
+    // the mode when the packet was read
+    FilterMode mode;
     static int status = EXIT_FAILURE; // static for return persistence
     status = EXIT_FAILURE;            // reset status
 
-    // keeps looping unless NOT_CANCELLED is set to 0, or read_packet returns -1
-    while(NOT_CANCELLED &&
-          (length = read_packet(spec_p->pipes.in_pipe, pktBuf, MAX_PKT_LENGTH)) != -1)
+    // the counters count the thread that opens them, so they are opened here
+    if(spec_p->perf != NULL && !start_perf_counters(spec_p->perf))
+        fprintf(stderr, "fw: ERROR: failed to open performance counters: %s\n",
+                strerror(errno));
+
+    // keeps looping until read_packet returns 0 for shutdown or -1 for error
+    while((length = read_packet(spec_p, pktBuf, MAX_PKT_LENGTH)) > 0)
     {
+        if(spec_p->perf != NULL)
+            end_perf_stage(spec_p->perf, PERF_STAGE_READ);
         // determines if the packet should be let through or not
-        if((MODE == MODE_FILTER && filter_packet(spec_p->filter, pktBuf)) ||
-            MODE == MODE_ALLOW_ALL)
+        mode = atomic_load_explicit(&MODE, memory_order_relaxed);
+        allowed = (mode == MODE_FILTER && filter_packet(spec_p->filter, pktBuf, length)) ||
+                  mode == MODE_ALLOW_ALL;
+        if(spec_p->perf != NULL)
+            end_perf_stage(spec_p->perf, PERF_STAGE_FILTER);
+        if(allowed)
         {
+            errno = 0;
             // writes the size of the packet
             if(fwrite(&length, sizeof(int), 1, spec_p->pipes.out_pipe) != 1)
                 fprintf(stderr, "fw: ERROR: there was an issue writing packet size.\n");
@@ -248,18 +529,33 @@ static void * filter_thread(void* args)
 
             // flushes the output for fwSim to read
             fflush(spec_p->pipes.out_pipe);
+            // nothing more can be passed on once the reader has gone
+            if(errno == EPIPE)
+            {
+                fprintf(stderr, "fw: ERROR: output pipe has no reader.\n");
+                length = -1;
+                break;
+            }
+            add_count(&spec_p->num_allowed, 1);
         }
+        else
+            add_count(&spec_p->num_blocked, 1);
+
+        // mirrors the packet after it has been passed on so it never delays it
+        if(spec_p->tap != NULL)
+            tap_packet(spec_p->tap, pktBuf, length, allowed);
+        if(spec_p->perf != NULL)
+            end_perf_stage(spec_p->perf, PERF_STAGE_WRITE);
     }
 
-    // sets not cancelled to false so main knows we are attempting to abort
-    NOT_CANCELLED = false;
+    // wakes main up in case the input ended before anyone asked us to stop
+    request_shutdown();
 
-    // end of thread is never reached when there is a cancellation.
-    puts("fw: thread is deleting filter data.");
-    tsd_destroy((void *)spec_p);
+    puts("fw: thread is cleaning up.");
+    filter_thread_cleanup((void *)spec_p);
 
     // changes status to be success if we broke the loop successfully
-    if(!NOT_CANCELLED && length != -1)
+    if(length == 0)
         status = EXIT_SUCCESS;
 
     // print that the thread is about to return
@@ -268,6 +564,344 @@ static void * filter_thread(void* args)
 }
 
 
+/// Runs as a thread and periodically has the filter reorder its rules
+/// based on what it has seen, until shutdown is requested.
+/// @param args pointer to an FWSpec_T structure
+/// @return always NULL
+static void * adapt_thread(void* args)
+{
+    FWSpec_T * spec_p = (FWSpec_T *) args;
+
+    // times out once per interval until the wake pipe says to stop
+    while(wait_readable(wake_pipe[0], ADAPT_INTERVAL_MS) == 0)
+        reorder_filter_rules(spec_p->filter);
+    return NULL;
+}
+
+
+/// Starts the thread that reorders the filter rules, unless it is already
+/// running or the configuration did not ask for ADAPTIVE_RULE_ORDER. Only
+/// main before the control thread starts, and then the control thread, may
+/// call this.
+/// @param spec_ptr the firewall specification
+static void start_adapt_thread(FWSpec_T *spec_ptr)
+{
+    if(adapt_started || !filter_adapts_rule_order(spec_ptr->filter))
+        return;
+    if(pthread_create(&tid_adapt, NULL, adapt_thread, (void *)spec_ptr) == 0)
+        adapt_started = true;
+    else
+        fputs("fw: ERROR: could not start the rule order thread.\n", stderr);
+}
+
+
+/// Creates the control socket, a Unix domain stream socket at the path
+/// given by the firewall specification, and starts listening on it.
+/// @param spec_ptr structure contains the control socket name.
+/// @return true if successful
+static bool open_control_socket(FWSpec_T *spec_ptr)
+{
+    struct sockaddr_un addr;
+
+    if(strlen(spec_ptr->control_file) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "fw: ERROR: control socket name %s is too long.\n",
+                spec_ptr->control_file);
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, spec_ptr->control_file);
+
+    // a socket left over from an earlier run would make bind fail
+    unlink(spec_ptr->control_file);
+    spec_ptr->control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(spec_ptr->control_fd == -1 ||
+       bind(spec_ptr->control_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+       listen(spec_ptr->control_fd, CONTROL_BACKLOG) == -1)
+    {
+        fprintf(stderr, "fw: ERROR: failed to open control socket %s: %s\n",
+                spec_ptr->control_file, strerror(errno));
+        if(spec_ptr->control_fd != -1)
+            close(spec_ptr->control_fd);
+        spec_ptr->control_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+
+/// Changes the mode of the firewall, and of the XDP program if there is one.
+/// @param spec_ptr the firewall specification
+/// @param mode the new mode
+static void set_mode(FWSpec_T *spec_ptr, FilterMode mode)
+{
+    atomic_store_explicit(&MODE, mode, memory_order_relaxed);
+    if(spec_ptr->xdp != NULL && !set_xdp_mode(spec_ptr->xdp, xdp_modes[mode]))
+        fprintf(stderr, "fw: ERROR: failed to set xdp mode: %s\n",
+                strerror(errno));
+}
+
+
+/// Parses a dotted decimal IP address such as 192.168.1.100
+/// @param str The string holding the address
+/// @param ipAddr Where to store the address packed into an unsigned int
+/// @return true if str held a valid address
+static bool parse_ip_address(const char *str, unsigned int *ipAddr)
+{
+    unsigned int octets[4];
+    char extra;
+
+    if(sscanf(str, "%u.%u.%u.%u %c", &octets[0], &octets[1], &octets[2],
+              &octets[3], &extra) != 4)
+        return false;
+    *ipAddr = 0;
+    for(int i = 0; i < 4; ++i)
+    {
+        if(octets[i] > 255)
+            return false;
+        *ipAddr = (*ipAddr << 8) | octets[i];
+    }
+    return true;
+}
+
+
+/// Carries out one command received on the control socket and writes the
+/// reply. Commands are single lines, replies end with a line that is either
+/// OK or ERR followed by the reason.
+///   MODE BLOCK|ALLOW|FILTER       change the firewall mode
+///   ADD IP a.b.c.d / DEL IP a.b.c.d   block or unblock an IP address
+///   ADD PORT n / DEL PORT n       block or unblock an inbound TCP port
+///   RELOAD                        re-read the configuration file
+///   STATS                         print the counters and filter settings,
+///                                 and the hardware counters with --perf
+///   SHUTDOWN                      exit the firewall
+/// @param spec_ptr the firewall specification
+/// @param line the command line
+/// @param out stream connected to the client
+static void handle_command(FWSpec_T *spec_ptr, char *line, FILE *out)
+{
+    static const char * const mode_names[] = { "block", "allow", "filter" };
+    char cmd[16] = "", what[16] = "", arg[MAX_CMD_LEN] = "";
+    unsigned int value;
+    char *end;
+    FilterUpdate result;
+
+    sscanf(line, "%15s %15s %127s", cmd, what, arg);
+
+    if(strcmp(cmd, "MODE") == 0)
+    {
+        if(strcmp(what, "BLOCK") == 0)
+            set_mode(spec_ptr, MODE_BLOCK_ALL);
+        else if(strcmp(what, "ALLOW") == 0)
+            set_mode(spec_ptr, MODE_ALLOW_ALL);
+        else if(strcmp(what, "FILTER") == 0)
+            set_mode(spec_ptr, MODE_FILTER);
+        else
+        {
+            fputs("ERR unknown mode\n", out);
+            return;
+        }
+    }
+    else if(strcmp(cmd, "ADD") == 0 || strcmp(cmd, "DEL") == 0)
+    {
+        bool add = cmd[0] == 'A';
+        if(strcmp(what, "IP") == 0 && parse_ip_address(arg, &value))
+            result = add ? add_filter_blocked_ip_address(spec_ptr->filter, value) :
+                           remove_filter_blocked_ip_address(spec_ptr->filter, value);
+        else if(strcmp(what, "PORT") == 0 &&
+                (value = strtoul(arg, &end, 10)) <= 65535 &&
+                *arg != '\0' && *end == '\0')
+            result = add ? add_filter_blocked_tcp_port(spec_ptr->filter, value) :
+                           remove_filter_blocked_tcp_port(spec_ptr->filter, value);
+        else
+        {
+            fputs("ERR bad address or port\n", out);
+            return;
+        }
+        if(result == FILTER_UPDATE_FAILED)
+        {
+            fputs("ERR out of memory\n", out);
+            return;
+        }
+        if(result == FILTER_UNCHANGED)
+        {
+            fputs(add ? "ERR already blocked\n" : "ERR not blocked\n", out);
+            return;
+        }
+        if(spec_ptr->xdp != NULL && !sync_xdp_filter(spec_ptr->xdp, spec_ptr->filter))
+        {
+            fputs("ERR xdp maps not updated\n", out);
+            return;
+        }
+    }
+    else if(strcmp(cmd, "RELOAD") == 0)
+    {
+        if(!configure_filter(spec_ptr->filter, spec_ptr->config_file))
+        {
+            fputs("ERR reload failed, keeping old configuration\n", out);
+            return;
+        }
+        // the new configuration may have turned on ADAPTIVE_RULE_ORDER
+        start_adapt_thread(spec_ptr);
+        if(spec_ptr->xdp != NULL && !sync_xdp_filter(spec_ptr->xdp, spec_ptr->filter))
+        {
+            fputs("ERR xdp maps not updated\n", out);
+            return;
+        }
+    }
+    else if(strcmp(cmd, "STATS") == 0)
+    {
+        unsigned long allowed = atomic_load(&spec_ptr->num_allowed);
+        unsigned long blocked = atomic_load(&spec_ptr->num_blocked);
+        unsigned long counts[NUM_XDP_COUNTERS];
+
+        // with XDP the packets never reach the filter thread
+        if(spec_ptr->xdp != NULL && read_xdp_counters(spec_ptr->xdp, counts))
+        {
+            allowed = counts[XDP_COUNT_ALLOWED];
+            blocked = 0;
+            for(int counter = XDP_COUNT_BLOCK_ALL; counter < NUM_XDP_COUNTERS; ++counter)
+                blocked += counts[counter];
+        }
+        fprintf(out, "mode: %s\n", mode_names[atomic_load(&MODE)]);
+        fprintf(out, "packets allowed: %lu\n", allowed);
+        fprintf(out, "packets blocked: %lu\n", blocked);
+        // the filter thread never sees a packet while XDP filters them
+        print_filter_stats(spec_ptr->filter, spec_ptr->xdp == NULL, out);
+        if(spec_ptr->xdp != NULL)
+            print_xdp_stats(spec_ptr->xdp, out);
+        if(spec_ptr->perf != NULL)
+            print_perf_counters(spec_ptr->perf, out);
+    }
+    else if(strcmp(cmd, "SHUTDOWN") == 0)
+        request_shutdown();
+    else
+    {
+        fputs("ERR unknown command\n", out);
+        return;
+    }
+    fputs("OK\n", out);
+}
+
+
+/// Accepts a connection to the control socket. A client that stops reading
+/// its replies can only hold up a reply for CONTROL_SEND_TIMEOUT_MS.
+/// @param spec_ptr the firewall specification
+/// @param client where to store the new client
+/// @return true if a client was accepted
+static bool accept_client(FWSpec_T *spec_ptr, ControlClient_T *client)
+{
+    struct timeval timeout = { CONTROL_SEND_TIMEOUT_MS / 1000,
+                               CONTROL_SEND_TIMEOUT_MS % 1000 * 1000 };
+    int fd = accept(spec_ptr->control_fd, NULL, NULL);
+
+    if(fd == -1)
+        return false;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    client->out = fdopen(fd, "w");
+    if(client->out == NULL)
+    {
+        close(fd);
+        return false;
+    }
+    client->reader.fd = fd;
+    client->reader.len = 0;
+    return true;
+}
+
+
+/// Reads what a control client has sent and carries out each whole command
+/// in it. Replies that fail, which they do with EPIPE once the client has
+/// gone or with EAGAIN once it has not read them for too long, drop the client.
+/// @param spec_ptr the firewall specification
+/// @param client the client that is readable
+/// @return false once the client should be dropped
+static bool serve_client(FWSpec_T *spec_ptr, ControlClient_T *client)
+{
+    LineReader_T *reader = &client->reader;
+    char line[MAX_CMD_LEN];
+
+    ssize_t numRead = read(reader->fd, reader->buf + reader->len,
+                           MAX_CMD_LEN - 1 - reader->len);
+    if(numRead == -1)
+        return errno == EINTR || errno == EAGAIN;
+    if(numRead == 0)
+        return false;
+    reader->len += numRead;
+
+    while(take_line(reader, line))
+    {
+        handle_command(spec_ptr, line, client->out);
+        if(fflush(client->out) == EOF)
+            return false;
+    }
+    return true;
+}
+
+
+/// Runs as a thread and serves the control socket. It waits on the socket
+/// and on every connected client at once, so an idle client never holds up
+/// the others. Each client may send any number of commands, one per line.
+/// Returns once shutdown is requested.
+/// @param args pointer to an FWSpec_T structure
+/// @return always NULL
+static void * control_thread(void* args)
+{
+    FWSpec_T * spec_p = (FWSpec_T *) args;
+    ControlClient_T clients[MAX_CONTROL_CLIENTS];
+    // the wake pipe, the control socket, then one per client
+    struct pollfd fds[2 + MAX_CONTROL_CLIENTS];
+    int numClients = 0;
+
+    while(atomic_load(&NOT_CANCELLED))
+    {
+        fds[0] = (struct pollfd){ wake_pipe[0], POLLIN, 0 };
+        // a full house leaves new connections waiting in the backlog
+        fds[1] = (struct pollfd){ spec_p->control_fd,
+                                  numClients < MAX_CONTROL_CLIENTS ? POLLIN : 0, 0 };
+        for(int i = 0; i < numClients; ++i)
+            fds[2 + i] = (struct pollfd){ clients[i].reader.fd, POLLIN, 0 };
+
+        if(poll(fds, 2 + numClients, -1) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(fds[0].revents != 0)
+            break;
+
+        // a dropped client is replaced by the last one, which is already done
+        for(int i = numClients - 1; i >= 0; --i)
+        {
+            if(fds[2 + i].revents != 0 && !serve_client(spec_p, &clients[i]))
+            {
+                fclose(clients[i].out);
+                clients[i] = clients[--numClients];
+            }
+        }
+        if(fds[1].revents != 0 && accept_client(spec_p, &clients[numClients]))
+            ++numClients;
+    }
+
+    for(int i = 0; i < numClients; ++i)
+        fclose(clients[i].out);
+    return NULL;
+}
+
+
+/// Waits for the control thread, which returns once shutdown is requested,
+/// then closes and removes the control socket.
+/// @param spec_ptr the firewall specification
+static void stop_control(FWSpec_T *spec_ptr)
+{
+    pthread_join(tid_control, NULL);
+    close(spec_ptr->control_fd);
+    unlink(spec_ptr->control_file);
+}
+
+
 /// Displays a prompt to stdout and menu of commands that a user can choose
 static void display_menu(void)
 {
@@ -275,18 +909,109 @@ static void display_menu(void)
     puts("\n\n1. Block All");
     puts("2. Allow All");
     puts("3. Filter");
+    if(fw_spec.perf != NULL)
+        puts("4. Performance Counters");
     puts("0. Exit");
     printf("> ");
     fflush(stdout);
 }
 
+/// Parses the command line options into the firewall specification.
+/// @param argc Number of command line arguments
+/// @param argv Command line arguments
+/// @param spec_ptr The firewall specification to fill in
+/// @return true if the options are valid and a config file was given
+static bool parse_options(int argc, char* argv[], FWSpec_T *spec_ptr)
+{
+    static const struct option long_options[] =
+    {
+        { "perf", no_argument, NULL, OPT_PERF },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    char * end;
+
+    // defaults: no control socket and no tap, and when there is a tap it
+    // mirrors every blocked packet
+    spec_ptr->control_file = NULL;
+    spec_ptr->tap_file = NULL;
+    spec_ptr->xdp_ifname = NULL;
+    spec_ptr->tap_select = TAP_BLOCKED;
+    spec_ptr->tap_rate = 1;
+    spec_ptr->drain = false;
+    spec_ptr->count_perf = false;
+
+    while((opt = getopt_long(argc, argv, "c:Dt:s:n:x:", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                spec_ptr->control_file = optarg;
+                break;
+            case 'D':
+                spec_ptr->drain = true;
+                break;
+            case 't':
+                spec_ptr->tap_file = optarg;
+                break;
+            case 's':
+                if(strcmp(optarg, "blocked") == 0)
+                    spec_ptr->tap_select = TAP_BLOCKED;
+                else if(strcmp(optarg, "allowed") == 0)
+                    spec_ptr->tap_select = TAP_ALLOWED;
+                else if(strcmp(optarg, "all") == 0)
+                    spec_ptr->tap_select = TAP_ALL;
+                else
+                    return false;
+                break;
+            case 'x':
+                spec_ptr->xdp_ifname = optarg;
+                break;
+            case 'n':
+                spec_ptr->tap_rate = strtoul(optarg, &end, 10);
+                if(*end != '\0' || spec_ptr->tap_rate == 0)
+                    return false;
+                break;
+            case OPT_PERF:
+                spec_ptr->count_perf = true;
+                break;
+            default:
+                return false;
+        }
+    }
+
+    // the config file is the one required argument
+    if(optind >= argc)
+        return false;
+    // packets filtered by XDP never pass through here to be tapped, drained
+    // or counted
+    if(spec_ptr->xdp_ifname != NULL &&
+       (spec_ptr->tap_file != NULL || spec_ptr->drain || spec_ptr->count_perf))
+        return false;
+    spec_ptr->config_file = argv[optind];
+    return true;
+}
+
+
 /// The firewall main function creates a filter and launches filtering thread.
 /// Then it handles user input with a simple menu and prompt.
-/// When the user requests and exit, the main cancels and joins the thread
-/// before exiting itself.
-/// Run this program with the configuration file as a command line argument.
-/// @param argc Number of command line arguments; 1 expected
-/// @param argv Command line arguments; name of the configuration file
+/// When the user requests an exit, the main requests shutdown and joins the
+/// threads before exiting itself.
+/// Run this program with the configuration file as a command line argument,
+/// after any of these options:
+///   -c socketName                 serve the control socket of handle_command
+///   -D                            at exit, filter what the input pipe holds
+///   -t tapFile                    mirror packets to a pcap file or pipe
+///   -s blocked|allowed|all        choose the packets -t mirrors
+///   -n N                          mirror 1 in N of them
+///   -x interface                  filter with XDP there, not the pipes
+///   --perf                        count hardware events per packet stage
+/// The counts of --perf are printed from the menu and at exit.
+/// An IPv4 fragment that arrives before the first fragment of its datagram is
+/// dropped, since there is no verdict to give it yet. With -x fragments are
+/// not tracked, later ones pass, and BLOCK_PAYLOAD rules are refused.
+/// @param argc Number of command line arguments; 1 or more expected
+/// @param argv Command line arguments; options and name of the config file
 /// @return EXIT_SUCCESS or EXIT_FAILURE
 int main(int argc, char* argv[])
 {
@@ -294,19 +1019,37 @@ int main(int argc, char* argv[])
     int command;
     // used to determine if the firewall is done running
     bool done = false;
+    // what read_line returned last
+    int result = 0;
+    // splits stdin into lines without blocking shutdown
+    LineReader_T stdin_reader = { STDIN_FILENO, 0, "" };
+    // a line of user input
+    char line[MAX_CMD_LEN];
 
-    // print usage message if no arguments
-    if(argc < 2)
+    // print usage message if the arguments are bad
+    if(!parse_options(argc, argv, &fw_spec))
     {
-        fprintf(stderr, "usage: %s configFileName\n", argv[0]);
+        fprintf(stderr, "usage: %s [options] configFileName\n"
+                "  -c controlSocket         serve rule updates and STATS\n"
+                "  -D                       at exit, filter what is queued\n"
+                "  -t tapFile               mirror packets to a pcap file or pipe\n"
+                "  -s blocked|allowed|all   choose the packets -t mirrors\n"
+                "  -n sampleRate            mirror 1 in sampleRate of them\n"
+                "  -x interface             filter with XDP on interface\n"
+                "  --perf                   count hardware events per stage\n"
+                "IPv4 fragments that come before the first one are dropped.\n"
+                "With -x fragments are not tracked, later ones pass, and\n"
+                "BLOCK_PAYLOAD rules are refused.\n",
+                argv[0]);
         return EXIT_FAILURE;
     }
 
-    // initializes the signal handlers
+    // initializes the wake pipe and then the signal handlers that use it
+    if(!open_wake_pipe())
+        return EXIT_FAILURE;
     init_sig_handlers();
 
-    // sets the three filename strings
-    fw_spec.config_file = argv[1];
+    // sets the two pipe filename strings
     fw_spec.in_file = "ToFirewall";
     fw_spec.out_file = "FromFirewall";
     // creates and configures the filter and exits if something goes wrong
@@ -317,29 +1060,99 @@ int main(int argc, char* argv[])
         destroy_filter(fw_spec.filter);
         return EXIT_FAILURE;
     }
+    // attaches the XDP program and fills its maps if one was asked for
+    fw_spec.xdp = NULL;
+    if(fw_spec.xdp_ifname != NULL)
+    {
+        fw_spec.xdp = create_xdp_filter(fw_spec.xdp_ifname);
+        if(fw_spec.xdp == NULL ||
+           !sync_xdp_filter(fw_spec.xdp, fw_spec.filter))
+        {
+            if(fw_spec.xdp != NULL)
+                destroy_xdp_filter(fw_spec.xdp);
+            destroy_filter(fw_spec.filter);
+            return EXIT_FAILURE;
+        }
+        printf("fw: filtering on %s with xdp.\n", fw_spec.xdp_ifname);
+    }
+    // starts the tap if one was asked for
+    fw_spec.tap = NULL;
+    if(fw_spec.tap_file != NULL)
+    {
+        fw_spec.tap = create_tap(fw_spec.tap_file, fw_spec.tap_select,
+                                 fw_spec.tap_rate);
+        if(fw_spec.tap == NULL)
+        {
+            if(fw_spec.xdp != NULL)
+                destroy_xdp_filter(fw_spec.xdp);
+            destroy_filter(fw_spec.filter);
+            return EXIT_FAILURE;
+        }
+    }
+    // makes room for the counters, which the filter thread opens
+    fw_spec.perf = NULL;
+    if(fw_spec.count_perf)
+    {
+        fw_spec.perf = create_perf_counters();
+        if(fw_spec.perf == NULL)
+        {
+            fputs("fw: ERROR: out of memory for performance counters.\n", stderr);
+            if(fw_spec.xdp != NULL)
+                destroy_xdp_filter(fw_spec.xdp);
+            destroy_filter(fw_spec.filter);
+            if(fw_spec.tap != NULL)
+                destroy_tap(fw_spec.tap);
+            return EXIT_FAILURE;
+        }
+    }
     // opens the pipes and exits if something goes wrong
-    if(!open_pipes(&fw_spec))
+    if(fw_spec.xdp == NULL && !open_pipes(&fw_spec))
     {
         // pipe opening was wrong, need to teardown and exit
         destroy_filter(fw_spec.filter);
+        if(fw_spec.tap != NULL)
+            destroy_tap(fw_spec.tap);
+        if(fw_spec.perf != NULL)
+            destroy_perf_counters(fw_spec.perf);
+        close_pipes(&fw_spec.pipes);
+        return EXIT_FAILURE;
+    }
+
+    // opens the control socket if one was asked for
+    fw_spec.control_fd = -1;
+    if(fw_spec.control_file != NULL && !open_control_socket(&fw_spec))
+    {
+        if(fw_spec.xdp != NULL)
+            destroy_xdp_filter(fw_spec.xdp);
+        destroy_filter(fw_spec.filter);
+        if(fw_spec.tap != NULL)
+            destroy_tap(fw_spec.tap);
+        if(fw_spec.perf != NULL)
+            destroy_perf_counters(fw_spec.perf);
         close_pipes(&fw_spec.pipes);
         return EXIT_FAILURE;
     }
 
-    // prints that we are going to start the listener thread
-    puts("fw: starting filter thread.");
-    // creates a pthread key
-    pthread_key_create(&tsd_key, tsd_destroy);
-    // starts the filter thread
-    pthread_create(&tid_filter, NULL, filter_thread, (void *)&fw_spec);
+    // prints that we are going to start the listener thread, which the
+    // XDP program takes the place of
+    if(fw_spec.xdp == NULL)
+    {
+        puts("fw: starting filter thread.");
+        pthread_create(&tid_filter, NULL, filter_thread, (void *)&fw_spec);
+    }
+    // starts the thread that keeps the rule order up to date, if it has to
+    start_adapt_thread(&fw_spec);
+    // starts the control thread
+    if(fw_spec.control_fd != -1)
+        pthread_create(&tid_control, NULL, control_thread, (void *)&fw_spec);
 
     // display the menu now
     display_menu();
     // keeps looping until the told it needs to stop
-    while(NOT_CANCELLED && !done)
+    while(!done && (result = read_line(&stdin_reader, line)) == 1)
     {
         // attempts to read in user input, only continues inward if 1 command
-        if(scanf("%d", &command) == 1)
+        if(sscanf(line, "%d", &command) == 1)
         {
             switch(command)
             {
@@ -349,15 +1162,19 @@ int main(int argc, char* argv[])
                     break;
                 case BLOCK:
                     puts("blocking all packets");
-                    MODE = MODE_BLOCK_ALL;
+                    set_mode(&fw_spec, MODE_BLOCK_ALL);
                     break;
                 case ALLOW:
                     puts("allowing all packets");
-                    MODE = MODE_ALLOW_ALL;
+                    set_mode(&fw_spec, MODE_ALLOW_ALL);
                     break;
                 case FILTER:
                     puts("filtering packets");
-                    MODE = MODE_FILTER;
+                    set_mode(&fw_spec, MODE_FILTER);
+                    break;
+                case PERF:
+                    if(fw_spec.perf != NULL)
+                        print_perf_counters(fw_spec.perf, stdout);
                     break;
             }
         }
@@ -366,20 +1183,52 @@ int main(int argc, char* argv[])
         fflush(stdout);
     }
 
+    // with stdin closed only a hangup, the control socket or the end of the
+    // input can stop the firewall
+    if(result == -1)
+        wait_readable(wake_pipe[0], -1);
+    if(HANGUP)
+        puts("\nfw: received Hangup request. Cancelling...");
+
     // when we get here we are exiting
     puts("\nExiting firewall");
+    request_shutdown();
+
+    // stops taking commands before the filter goes away
+    if(fw_spec.control_fd != -1)
+        stop_control(&fw_spec);
+
+    if(fw_spec.xdp != NULL)
+    {
+        puts("fw: main is detaching the xdp program.");
+        print_xdp_stats(fw_spec.xdp, stdout);
+        destroy_xdp_filter(fw_spec.xdp);
+    }
+    else
+    {
+        puts("fw: main is joining the thread.");
+
+        // wait for the filter thread to finish what it is doing and terminate
+        void * retval = NULL;
+        int joinResult = pthread_join(tid_filter, &retval);
+        if(joinResult != 0)
+            printf("fw: main Error: unexpected joinResult: %d\n", joinResult);
+        else
+            printf("fw: main joined the thread. status: %d\n", *(int *)retval);
+    }
+    if(fw_spec.perf != NULL)
+    {
+        // what the rules did, which the counts per packet depend on
+        print_filter_stats(fw_spec.filter, fw_spec.xdp == NULL, stdout);
+        print_perf_counters(fw_spec.perf, stdout);
+        destroy_perf_counters(fw_spec.perf);
+    }
 
-    // cancels the thread to unblock it
-    pthread_cancel(tid_filter);
-    puts("fw: main is joining the thread.");
-
-    // wait for the filter thread to terminate
-    void * retval = NULL;
-    int joinResult = pthread_join(tid_filter, &retval);
-    if(joinResult != 0)
-        printf("fw: main Error: unexpected joinResult: %d\n", joinResult);
-    if ((void*)retval == PTHREAD_CANCELED)
-        puts("fw: main confirmed that the thread was canceled.");
+    // nothing else uses the filter once the adapt thread is gone
+    if(adapt_started)
+        pthread_join(tid_adapt, NULL);
+    puts("fw: main is deleting filter data.");
+    destroy_filter(fw_spec.filter);
 
     puts("fw: main returning.");
     return EXIT_SUCCESS;
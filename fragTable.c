@@ -0,0 +1,468 @@
+/// \file fragTable.c
+/// \brief Remembers the verdict on the first fragment of a fragmented IPv4
+/// datagram so the rest of its fragments get the same one, in a table of
+/// fixed size.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+///
+/// Only the first fragment of a datagram holds the TCP, UDP or ICMP header,
+/// so it is the only one the filter rules can judge. The table is keyed on
+/// the source, destination, identification and protocol of the datagram,
+/// which every fragment carries.
+///
+/// Each entry keeps the byte ranges of the datagram its fragments covered so
+/// far, so a fragment that repeats or overlaps one already seen is caught and
+/// never counted twice. Adjacent ranges are merged; the datagram is complete
+/// when one range runs from 0 to the end given by the last fragment.
+///
+/// The table is split into sets of FRAG_WAYS entries, two cache lines each.
+/// A datagram hashes to one set and only ever lives there, so a lookup or an
+/// insert looks at FRAG_WAYS entries no matter how full the table is or how
+/// fast fragments arrive. The hash is keyed with random bits picked when the
+/// table is created, so a flood can't be aimed at the set of one datagram.
+
+/// needed for clock_gettime and CLOCK_MONOTONIC_COARSE
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/random.h>
+#include <time.h>
+#include "fragTable.h"
+#include "pktUtility.h"
+#include "statCount.h"
+
+/// entries in a set, the most datagrams that may share a hash
+#define FRAG_WAYS 4
+
+/// disjoint byte ranges an entry keeps; a datagram whose fragments arrive
+/// in more pieces than this at once has the fragment that would make one more
+/// blocked
+#define FRAG_RANGES 3
+
+/// most data bytes an IP datagram can hold
+#define FRAG_MAX_DATA 65535
+
+/// length of the IP header, which like pktUtility assumes has no options
+#define IP_HEADER_LEN 20
+
+/// The data bytes of a datagram that some of its fragments covered
+typedef struct FragRange_S
+{
+    unsigned short start;                      ///< offset of the first byte
+    unsigned short end;                        ///< offset after the last byte
+} FragRange;
+
+/// The type of an entry, one datagram whose first fragment was allowed. It
+/// fills 32 bytes so that a set of FRAG_WAYS is two cache lines.
+typedef struct FragEntry_S
+{
+    unsigned int srcIpAddr;                    ///< source of the datagram
+    unsigned int dstIpAddr;                    ///< destination of it
+    unsigned short id;                         ///< its identification field
+    unsigned char protocol;                    ///< its protocol field
+    bool used;                                 ///< false if the entry is free
+    unsigned int expires;                      ///< second it is forgotten
+    unsigned short firstEnd;                   ///< data bytes in the first
+                                               ///< fragment
+    unsigned short total;                      ///< data bytes in the whole
+                                               ///< datagram, 0 until the last
+                                               ///< fragment is seen
+    FragRange ranges[FRAG_RANGES];             ///< bytes seen so far, sorted;
+                                               ///< the first starts at 0 and
+                                               ///< unused ones end at 0
+} FragEntry;
+
+/// The fields every fragment of a datagram shares
+typedef struct FragKey_S
+{
+    unsigned int srcIpAddr;                    ///< source of the datagram
+    unsigned int dstIpAddr;                    ///< destination of it
+    unsigned short id;                         ///< its identification field
+    unsigned char protocol;                    ///< its protocol field
+} FragKey;
+
+/// The type used to hold a fragment table
+typedef struct Frag_S
+{
+    unsigned int setMask;                      ///< number of sets less one
+    unsigned int timeout;                      ///< seconds a datagram lasts
+    uint64_t hashKey;                          ///< random bits for the hash
+    FragEntry* entries;                        ///< the sets, line aligned
+    atomic_ulong firstAllowed;                 ///< first fragments recorded
+    atomic_ulong passed;                       ///< later fragments allowed
+    atomic_ulong completed;                    ///< datagrams seen in full
+    atomic_ulong unknown;                      ///< later fragments of
+                                               ///< datagrams not recorded
+    atomic_ulong overlaps;                     ///< fragments over the first
+    atomic_ulong repeats;                      ///< fragments over a later one
+    atomic_ulong scattered;                    ///< fragments past FRAG_RANGES
+    atomic_ulong malformed;                    ///< fragments empty or past
+                                               ///< the end
+    atomic_ulong tiny;                         ///< first fragments cut short
+    atomic_ulong evicted;                      ///< datagrams pushed out
+} Frag;
+
+
+/// Reads the clock the timeouts are measured with. The coarse clock is
+/// enough for whole seconds and costs a fraction of the precise one.
+/// @return The current time in seconds
+static unsigned int now_seconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (unsigned int)now.tv_sec;
+}
+
+
+/// Finds the number of data bytes in a fragment. The fragment ends where its
+/// IP header says it does, unless fewer bytes than that were received.
+/// @param pkt The fragment
+/// @param length The number of bytes received
+/// @return The number of bytes after the IP header
+static unsigned int fragment_data_length(const unsigned char* pkt, unsigned int length)
+{
+    unsigned int ipLength = (unsigned int)pkt[2] << 8 | pkt[3];
+
+    if(ipLength < length)
+        length = ipLength;
+    return length > IP_HEADER_LEN ? length - IP_HEADER_LEN : 0;
+}
+
+
+/// Reads the fields that identify the datagram a fragment belongs to.
+/// @param pkt The fragment
+/// @param key Where the fields are stored
+static void read_key(unsigned char* pkt, FragKey* key)
+{
+    key->srcIpAddr = ExtractSrcAddrFromIpHeader(pkt);
+    key->dstIpAddr = ExtractDstAddrFromIpHeader(pkt);
+    key->id = (unsigned short)(pkt[4] << 8 | pkt[5]);
+    key->protocol = ExtractIpProtocol(pkt);
+}
+
+
+/// Finds the set a datagram hashes to, by mixing its key with the random
+/// bits of the table (the 64 bit finalizer of MurmurHash3).
+/// @param frag The table
+/// @param key The datagram
+/// @return The first entry of the set
+static FragEntry* find_set(const Frag* frag, const FragKey* key)
+{
+    uint64_t h = ((uint64_t)key->srcIpAddr << 32 | key->dstIpAddr) ^ frag->hashKey;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33 ^ ((unsigned int)key->id << 8 | key->protocol);
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return frag->entries + (h & frag->setMask) * FRAG_WAYS;
+}
+
+
+/// Looks for the entry of a datagram in its set. Entries past their timeout
+/// are freed on the way.
+/// @param set The set of the datagram
+/// @param key The datagram
+/// @param now The current time in seconds
+/// @return The entry, NULL if the datagram isn't in the table
+static FragEntry* find_entry(FragEntry* set, const FragKey* key, unsigned int now)
+{
+    for(int way = 0; way < FRAG_WAYS; ++way)
+    {
+        FragEntry* entry = &set[way];
+
+        // wraps correctly when the clock passes 2^32 seconds
+        if(entry->used && (int)(entry->expires - now) <= 0)
+            entry->used = false;
+        if(entry->used && entry->srcIpAddr == key->srcIpAddr &&
+           entry->dstIpAddr == key->dstIpAddr && entry->id == key->id &&
+           entry->protocol == key->protocol)
+            return entry;
+    }
+    return NULL;
+}
+
+
+/// Creates a fragment table with all of its sets allocated up front.
+/// @param numEntries The most datagrams tracked at once
+/// @param timeout Seconds a datagram is remembered
+/// @return A pointer to the new table, NULL if memory ran out
+FragTable create_frag_table(unsigned int numEntries, unsigned int timeout)
+{
+    Frag* frag = malloc(sizeof(Frag));
+    size_t numSets = 1;
+
+    if(frag == NULL)
+    {
+        perror("Error creating fragment table");
+        return NULL;
+    }
+    while(numSets * FRAG_WAYS < numEntries)
+        numSets *= 2;
+    frag->setMask = numSets - 1;
+    frag->timeout = timeout;
+    frag->entries = aligned_alloc(sizeof(FragEntry) * FRAG_WAYS,
+                                  sizeof(FragEntry) * FRAG_WAYS * numSets);
+    if(frag->entries == NULL)
+    {
+        perror("Error creating fragment table");
+        free(frag);
+        return NULL;
+    }
+    memset(frag->entries, 0, sizeof(FragEntry) * FRAG_WAYS * numSets);
+
+    // without random bits the table still works, it is just easier to aim at
+    if(getrandom(&frag->hashKey, sizeof(frag->hashKey), 0) != sizeof(frag->hashKey))
+        frag->hashKey = (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL;
+
+    atomic_init(&frag->firstAllowed, 0);
+    atomic_init(&frag->passed, 0);
+    atomic_init(&frag->completed, 0);
+    atomic_init(&frag->unknown, 0);
+    atomic_init(&frag->overlaps, 0);
+    atomic_init(&frag->repeats, 0);
+    atomic_init(&frag->scattered, 0);
+    atomic_init(&frag->malformed, 0);
+    atomic_init(&frag->tiny, 0);
+    atomic_init(&frag->evicted, 0);
+    return (FragTable) frag;
+}
+
+
+/// Destroys a fragment table by freeing its sets and the table.
+/// @param table The table that is to be destroyed
+void destroy_frag_table(FragTable table)
+{
+    Frag* frag = table;
+
+    free(frag->entries);
+    free(frag);
+}
+
+
+/// Records the first fragment of a datagram if the rules allowed it.
+/// @param table The table to use
+/// @param pkt The first fragment
+/// @param length The number of bytes received
+/// @param allowed The verdict of the rules
+/// @return The verdict to use for the fragment
+bool frag_table_first(FragTable table, unsigned char* pkt, unsigned int length,
+                      bool allowed)
+{
+    Frag* frag = table;
+    unsigned int now = now_seconds();
+    unsigned int dataLength = fragment_data_length(pkt, length);
+    unsigned int headerLength;
+    FragKey key;
+    FragEntry* set;
+    FragEntry* entry;
+
+    read_key(pkt, &key);
+    set = find_set(frag, &key);
+    entry = find_entry(set, &key, now);
+
+    // a second first fragment may carry a different header than the one
+    // that was judged, so neither copy can be trusted
+    if(entry != NULL)
+    {
+        entry->used = false;
+        add_count(&frag->overlaps, 1);
+        return false;
+    }
+    if(!allowed)
+        return false;
+
+    // the rules read the ports of TCP and the type of ICMP; a first fragment
+    // that stops short of them leaves them to a later fragment (RFC 1858)
+    switch(key.protocol)
+    {
+        case IP_PROTOCOL_TCP:
+            headerLength = 20;
+            break;
+        case IP_PROTOCOL_UDP:
+        case IP_PROTOCOL_ICMP:
+            headerLength = 8;
+            break;
+        default:
+            headerLength = 0;
+            break;
+    }
+    if(dataLength < headerLength)
+    {
+        add_count(&frag->tiny, 1);
+        return false;
+    }
+
+    // takes a free entry of the set, or else the one that expires first
+    entry = &set[0];
+    for(int way = 0; way < FRAG_WAYS && entry->used; ++way)
+        if(!set[way].used || (int)(set[way].expires - entry->expires) < 0)
+            entry = &set[way];
+    if(entry->used)
+        add_count(&frag->evicted, 1);
+
+    entry->srcIpAddr = key.srcIpAddr;
+    entry->dstIpAddr = key.dstIpAddr;
+    entry->id = key.id;
+    entry->protocol = key.protocol;
+    entry->used = true;
+    entry->expires = now + frag->timeout;
+    entry->firstEnd = dataLength;
+    entry->total = 0;
+    memset(entry->ranges, 0, sizeof(entry->ranges));
+    entry->ranges[0].end = dataLength;
+    add_count(&frag->firstAllowed, 1);
+    return true;
+}
+
+
+/// Counts the ranges of a datagram in use. The first always is, since it
+/// holds the first fragment, even one without data.
+/// @param entry The datagram
+/// @return The number of ranges
+static int count_ranges(const FragEntry* entry)
+{
+    int numRanges = 1;
+
+    while(numRanges < FRAG_RANGES && entry->ranges[numRanges].end != 0)
+        ++numRanges;
+    return numRanges;
+}
+
+
+/// Adds the bytes of a fragment to the ranges of its datagram, joining the
+/// ranges it touches. The fragment must not overlap any of them.
+/// @param entry The datagram
+/// @param start Offset of the first data byte of the fragment
+/// @param end Offset after its last data byte, more than start
+/// @return False if the datagram would need more than FRAG_RANGES ranges
+static bool add_range(FragEntry* entry, unsigned int start, unsigned int end)
+{
+    FragRange* ranges = entry->ranges;
+    int numRanges = count_ranges(entry);
+    int i = 1;
+
+    // i is the first range after the fragment
+    while(i < numRanges && ranges[i].start < start)
+        ++i;
+    bool joinsLeft = ranges[i - 1].end == start;
+    bool joinsRight = i < numRanges && ranges[i].start == end;
+
+    if(joinsLeft && joinsRight)
+    {
+        // fills the gap between two ranges, which become one
+        ranges[i - 1].end = ranges[i].end;
+        memmove(&ranges[i], &ranges[i + 1],
+                sizeof(FragRange) * (numRanges - 1 - i));
+        memset(&ranges[numRanges - 1], 0, sizeof(FragRange));
+    }
+    else if(joinsLeft)
+        ranges[i - 1].end = end;
+    else if(joinsRight)
+        ranges[i].start = start;
+    else
+    {
+        if(numRanges == FRAG_RANGES)
+            return false;
+        memmove(&ranges[i + 1], &ranges[i],
+                sizeof(FragRange) * (numRanges - i));
+        ranges[i].start = start;
+        ranges[i].end = end;
+    }
+    return true;
+}
+
+
+/// Gives a later fragment the verdict recorded for its datagram, if its bytes
+/// are new. Once every byte of the datagram has been seen the entry is freed.
+/// @param table The table to use
+/// @param pkt The fragment
+/// @param length The number of bytes received
+/// @return True if the fragment is allowed
+bool frag_table_rest(FragTable table, unsigned char* pkt, unsigned int length)
+{
+    Frag* frag = table;
+    unsigned int field = IP_FRAG_FIELD(pkt);
+    unsigned int start = (field & IP_FRAG_OFFSET) * 8;
+    unsigned int end = start + fragment_data_length(pkt, length);
+    bool last = (field & IP_FRAG_MORE) == 0;
+    int numRanges;
+    FragKey key;
+    FragEntry* entry;
+
+    read_key(pkt, &key);
+    entry = find_entry(find_set(frag, &key), &key, now_seconds());
+    if(entry == NULL)
+    {
+        add_count(&frag->unknown, 1);
+        return false;
+    }
+    // bytes over the first fragment could rewrite the header it was judged
+    // on, so the whole datagram is dropped
+    if(start < entry->firstEnd)
+    {
+        entry->used = false;
+        add_count(&frag->overlaps, 1);
+        return false;
+    }
+    // a fragment has to carry data, and a datagram can't end past 64 KiB, or
+    // where its last fragment said not to, or twice in different places
+    numRanges = count_ranges(entry);
+    if(end == start || end > FRAG_MAX_DATA || (entry->total != 0 && end > entry->total) ||
+       (last && (entry->total != 0 ? end != entry->total :
+                 end < entry->ranges[numRanges - 1].end)))
+    {
+        add_count(&frag->malformed, 1);
+        return false;
+    }
+    // a repeat or a fragment over another later one adds nothing new
+    for(int i = 0; i < numRanges; ++i)
+    {
+        if(start < entry->ranges[i].end && end > entry->ranges[i].start)
+        {
+            add_count(&frag->repeats, 1);
+            return false;
+        }
+    }
+    if(!add_range(entry, start, end))
+    {
+        add_count(&frag->scattered, 1);
+        return false;
+    }
+
+    if(last)
+        entry->total = end;
+    if(entry->total != 0 && entry->ranges[0].end == entry->total)
+    {
+        entry->used = false;
+        add_count(&frag->completed, 1);
+    }
+    add_count(&frag->passed, 1);
+    return true;
+}
+
+
+/// Prints the size of the table and its counters.
+/// @param table The table to describe
+/// @param out The stream to print to
+void print_frag_table_stats(FragTable table, FILE* out)
+{
+    Frag* frag = table;
+    unsigned int numEntries = (frag->setMask + 1) * FRAG_WAYS;
+
+    fprintf(out, "fragment table: %u datagrams, %zu bytes, %u second timeout\n",
+            numEntries, numEntries * sizeof(FragEntry), frag->timeout);
+    fprintf(out, "fragments allowed: %lu first, %lu later, %lu datagrams "
+            "complete\n", atomic_load(&frag->firstAllowed),
+            atomic_load(&frag->passed), atomic_load(&frag->completed));
+    fprintf(out, "fragments blocked: %lu of unknown datagrams, %lu overlapping "
+            "the first, %lu repeated, %lu too scattered, %lu empty or past the "
+            "end, %lu too short; %lu datagrams evicted\n",
+            atomic_load(&frag->unknown), atomic_load(&frag->overlaps),
+            atomic_load(&frag->repeats),
+            atomic_load(&frag->scattered), atomic_load(&frag->malformed),
+            atomic_load(&frag->tiny), atomic_load(&frag->evicted));
+}
@@ -0,0 +1,79 @@
+/// \file fragTable.h
+/// \brief Remembers the verdict on the first fragment of a fragmented IPv4
+/// datagram so the rest of its fragments get the same one, in a table of
+/// fixed size.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __FRAG_TABLE_H__
+#define __FRAG_TABLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/// the more fragments flag of the flags and fragment offset field
+#define IP_FRAG_MORE 0x2000
+
+/// the fragment offset, in units of 8 bytes, of the same field
+#define IP_FRAG_OFFSET 0x1fff
+
+/// reads the flags and fragment offset field of an IP packet, which is a
+/// fragment if the field has either of the bits above set
+#define IP_FRAG_FIELD(pkt) ((unsigned int)(pkt)[6] << 8 | (pkt)[7])
+
+
+/// The type used by the client to store/use a fragment table instance
+typedef void* FragTable;
+
+
+/// Creates a fragment table. All of its memory is allocated here; once the
+/// entries a datagram may go in are full, the oldest of them is forgotten
+/// to make room.
+/// @param numEntries The most datagrams tracked at once, rounded up to a
+/// power of 2
+/// @param timeout Seconds after its first fragment that a datagram is
+/// forgotten
+/// @return A pointer to the new instance, NULL if memory ran out
+FragTable create_frag_table(unsigned int numEntries, unsigned int timeout);
+
+
+/// Destroys a fragment table instance and frees its memory.
+/// @param table The instance to destroy
+void destroy_frag_table(FragTable table);
+
+
+/// Records the verdict on the first fragment of a datagram. Only allowed
+/// datagrams are recorded; the other fragments of any other datagram are
+/// blocked. A first fragment too short to hold the header the rules read,
+/// or a second copy of one, is blocked too. Only one thread at a time may
+/// use an instance for fragments.
+/// @param table The instance to use
+/// @param pkt The first fragment
+/// @param length The number of bytes received
+/// @param allowed The verdict of the filter rules on it
+/// @return The verdict to use for the fragment
+bool frag_table_first(FragTable table, unsigned char* pkt, unsigned int length,
+                      bool allowed);
+
+
+/// Looks up the verdict on a fragment other than the first. A fragment that
+/// overlaps the first one could rewrite the header the verdict was made on,
+/// so it is blocked and the datagram is forgotten. A fragment that is empty,
+/// repeats or overlaps a later one, ends past the end of the datagram, or
+/// leaves it in too many pieces to keep track of is blocked, and the datagram
+/// is kept. A fragment of a datagram with no first fragment recorded is
+/// blocked too, whether that one was blocked, expired or is yet to arrive;
+/// fragments are judged as they come and never held back.
+/// @param table The instance to use
+/// @param pkt The fragment
+/// @param length The number of bytes received
+/// @return True if the first fragment was allowed and this one is safe
+bool frag_table_rest(FragTable table, unsigned char* pkt, unsigned int length);
+
+
+/// Prints the size of a fragment table and what it did with fragments.
+/// @param table The instance to describe
+/// @param out The stream to print to
+void print_frag_table_stats(FragTable table, FILE* out);
+
+#endif
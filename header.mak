@@ -1,4 +1,4 @@
-CFLAGS =     -ggdb -std=c99 -Wall -Wextra -pedantic -O2 -pthread
+CFLAGS =     -ggdb -std=c11 -Wall -Wextra -pedantic -O2 -pthread
 LOCAL_LIBS = pktUtility.o
 CLIBFLAGS = $(LOCAL_LIBS) -lm -lpthread 
 
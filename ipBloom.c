@@ -0,0 +1,199 @@
+/// \file ipBloom.c
+/// \brief A blocked Bloom filter over IPv4 addresses, used to rule out most
+/// addresses that are not in a large blocklist with a single cache line read.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+///
+/// The bit array is split into 64 byte blocks, one cache line each. An
+/// address hashes to one block and sets one bit in each of the 8 words of
+/// that block, so a lookup touches exactly one cache line no matter how many
+/// addresses the filter holds.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ipBloom.h"
+
+/// number of 64 bit words in a block, 8 words fill one 64 byte cache line
+#define BLOOM_BLOCK_WORDS 8
+
+/// size of a block in bytes
+#define BLOOM_BLOCK_SIZE (BLOOM_BLOCK_WORDS * sizeof(uint64_t))
+
+/// bits of filter per address; 16 keeps false positives well under 1%
+#define BLOOM_BITS_PER_ADDR 16
+
+/// odd multipliers picking a different bit in each word of a block
+static const uint32_t bloomSalts[BLOOM_BLOCK_WORDS] =
+{
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+/// The type used to hold a Bloom filter
+typedef struct Bloom_S
+{
+    uint64_t numBlocks;                        ///< number of blocks
+    uint64_t* blocks;                          ///< the bit array, line aligned
+} Bloom;
+
+
+/// Mixes the bits of an address so that every bit of the result depends on
+/// every bit of the address (the 64 bit finalizer of MurmurHash3).
+/// @param addr The IP address to hash
+/// @return The hash of the address
+static uint64_t hash_address(unsigned int addr)
+{
+    uint64_t h = addr;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/// Finds the block an address hashes to. The high half of the hash is scaled
+/// onto the number of blocks, which avoids a division.
+/// @param bloom The filter
+/// @param h The hash of the address
+/// @return The first word of the block
+static uint64_t* find_block(const Bloom* bloom, uint64_t h)
+{
+    return bloom->blocks + ((h >> 32) * bloom->numBlocks >> 32) * BLOOM_BLOCK_WORDS;
+}
+
+
+/// Sets the bits of an address in its block.
+/// @param bloom The filter
+/// @param addr The IP address to add
+static void set_address_bits(Bloom* bloom, unsigned int addr)
+{
+    uint64_t h = hash_address(addr);
+    uint64_t* block = find_block(bloom, h);
+    uint32_t key = (uint32_t)h;
+
+    // the top 6 bits of each salted key choose a bit in its word
+    for(int word = 0; word < BLOOM_BLOCK_WORDS; ++word)
+        block[word] |= 1ULL << ((uint32_t)(key * bloomSalts[word]) >> 26);
+}
+
+
+/// Allocates a Bloom filter with a cleared bit array of some number of blocks.
+/// @param numBlocks The number of blocks, at least 1
+/// @return A pointer to the new filter, NULL if memory ran out
+static Bloom* alloc_bloom(uint64_t numBlocks)
+{
+    Bloom* bloom = malloc(sizeof(Bloom));
+
+    if(bloom == NULL)
+    {
+        perror("Error creating bloom filter");
+        return NULL;
+    }
+
+    bloom->numBlocks = numBlocks;
+    bloom->blocks = aligned_alloc(BLOOM_BLOCK_SIZE,
+                                  bloom->numBlocks * BLOOM_BLOCK_SIZE);
+    if(bloom->blocks == NULL)
+    {
+        perror("Error creating bloom filter");
+        free(bloom);
+        return NULL;
+    }
+    memset(bloom->blocks, 0, bloom->numBlocks * BLOOM_BLOCK_SIZE);
+    return bloom;
+}
+
+
+/// Creates a Bloom filter by sizing the bit array for the number of
+/// addresses and setting the bits of each one.
+/// @param addrs The IP addresses to add
+/// @param numAddrs The number of addresses
+/// @return A pointer to the new filter, NULL if memory ran out
+IpBloom create_ip_bloom(const unsigned int* addrs, unsigned int numAddrs)
+{
+    uint64_t numBlocks = ((uint64_t)numAddrs * BLOOM_BITS_PER_ADDR + 511) / 512;
+    Bloom* bloom = alloc_bloom(numBlocks > 0 ? numBlocks : 1);
+
+    if(bloom == NULL)
+        return NULL;
+    for(unsigned int i = 0; i < numAddrs; ++i)
+        set_address_bits(bloom, addrs[i]);
+    return (IpBloom) bloom;
+}
+
+
+/// Copies a Bloom filter by allocating a bit array of the same size and
+/// copying the bits.
+/// @param bloom The filter to copy
+/// @return A pointer to the copy, NULL if memory ran out
+IpBloom copy_ip_bloom(IpBloom bloom)
+{
+    const Bloom* pBloom = bloom;
+    Bloom* copy = alloc_bloom(pBloom->numBlocks);
+
+    if(copy != NULL)
+        memcpy(copy->blocks, pBloom->blocks, copy->numBlocks * BLOOM_BLOCK_SIZE);
+    return (IpBloom) copy;
+}
+
+
+/// Adds an address to a Bloom filter by setting its bits.
+/// @param bloom The filter to add to
+/// @param addr The IP address to add
+void ip_bloom_add(IpBloom bloom, unsigned int addr)
+{
+    set_address_bits(bloom, addr);
+}
+
+
+/// Works out how many addresses the bit array of a Bloom filter was sized
+/// for.
+/// @param bloom The filter to measure
+/// @return The number of addresses
+unsigned int ip_bloom_capacity(IpBloom bloom)
+{
+    return ((Bloom*)bloom)->numBlocks * 512 / BLOOM_BITS_PER_ADDR;
+}
+
+
+/// Destroys a Bloom filter by freeing the bit array and the filter.
+/// @param bloom The filter that is to be destroyed
+void destroy_ip_bloom(IpBloom bloom)
+{
+    Bloom* pBloom = bloom;
+
+    free(pBloom->blocks);
+    free(pBloom);
+}
+
+
+/// Checks the bits an address would have set in its block. All the words
+/// are checked without branching, since they share a cache line anyway.
+/// @param bloom The filter to use
+/// @param addr The IP address to check
+/// @return False if addr was definitely not added
+bool ip_bloom_may_contain(IpBloom bloom, unsigned int addr)
+{
+    const Bloom* pBloom = bloom;
+    uint64_t h = hash_address(addr);
+    const uint64_t* block = find_block(pBloom, h);
+    uint32_t key = (uint32_t)h;
+    uint64_t found = 1;
+
+    for(int word = 0; word < BLOOM_BLOCK_WORDS; ++word)
+        found &= block[word] >> ((uint32_t)(key * bloomSalts[word]) >> 26);
+    return found & 1;
+}
+
+
+/// Reports the memory used by the bit array of a Bloom filter.
+/// @param bloom The filter to measure
+/// @return The size of the bit array in bytes
+size_t ip_bloom_size(IpBloom bloom)
+{
+    return ((Bloom*)bloom)->numBlocks * BLOOM_BLOCK_SIZE;
+}
@@ -0,0 +1,64 @@
+/// \file ipBloom.h
+/// \brief A blocked Bloom filter over IPv4 addresses, used to rule out most
+/// addresses that are not in a large blocklist with a single cache line read.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __IP_BLOOM_H__
+#define __IP_BLOOM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/// The type used by the client to store/use a Bloom filter instance
+typedef void* IpBloom;
+
+
+/// Creates a Bloom filter holding the given addresses. Addresses can be added
+/// later but never taken out; build a new one when addresses are removed.
+/// @param addrs The IP addresses to add
+/// @param numAddrs The number of addresses
+/// @return A pointer to the new instance, NULL if memory ran out
+IpBloom create_ip_bloom(const unsigned int* addrs, unsigned int numAddrs);
+
+
+/// Copies a Bloom filter instance, so that addresses can be added to the copy
+/// while the original is still in use.
+/// @param bloom The instance to copy
+/// @return A pointer to the copy, NULL if memory ran out
+IpBloom copy_ip_bloom(IpBloom bloom);
+
+
+/// Adds an address to a Bloom filter instance. The filter must not be in use
+/// by another thread.
+/// @param bloom The instance to add to
+/// @param addr The IP address to add
+void ip_bloom_add(IpBloom bloom, unsigned int addr);
+
+
+/// Reports how many addresses a Bloom filter instance was sized for. It
+/// keeps working with more, but its false positive rate climbs.
+/// @param bloom The instance to measure
+/// @return The number of addresses
+unsigned int ip_bloom_capacity(IpBloom bloom);
+
+
+/// Destroys a Bloom filter instance and frees its memory.
+/// @param bloom The instance to destroy
+void destroy_ip_bloom(IpBloom bloom);
+
+
+/// Checks if an address may be in the filter. Never says no for an address
+/// that was added, but may say yes for one that was not.
+/// @param bloom The instance to use
+/// @param addr The IP address to check
+/// @return False if addr was definitely not added
+bool ip_bloom_may_contain(IpBloom bloom, unsigned int addr);
+
+
+/// Reports how much memory a Bloom filter instance uses.
+/// @param bloom The instance to measure
+/// @return The size of the bit array in bytes
+size_t ip_bloom_size(IpBloom bloom);
+
+#endif
@@ -0,0 +1,618 @@
+/// \file payloadScan.c
+/// \brief Searches packet payloads for any of a set of byte patterns at once
+/// with an Aho-Corasick automaton.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+///
+/// The patterns are put in a trie, failure links are worked out on it, and
+/// the two are then folded into a DFA: every state has a transition on every
+/// byte, so a scan takes exactly one step per byte with no failure links to
+/// follow.
+///
+/// Most transitions of a state lead where the same byte leads from the start
+/// state, so a state only keeps the others. A 256 bit bitmap tells which
+/// bytes those are, and the transition on a byte is found by counting the
+/// bits below it. The bitmaps and their offsets fill one 64 byte cache line
+/// per state. States that end a pattern are numbered after all the others;
+/// a scan stops as soon as it reaches one, so they need no row at all.
+///
+/// While the scan is in the start state it skips ahead to the next byte that
+/// begins some pattern. With SSSE3 that test is done 16 bytes at a time with
+/// two nibble lookups (pshufb), which may let a few other bytes through but
+/// never skips one that begins a pattern. When many different bytes begin a
+/// pattern there is little to skip, and the prefilter is left out.
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#endif
+#include "payloadScan.h"
+
+/// no edge, in the edge lists of the trie under construction
+#define NO_EDGE UINT32_MAX
+
+/// buckets the prefilter sorts the high nibbles into, one bit of a byte each
+#define NUM_BUCKETS 8
+
+/// the most different bytes that may begin a pattern for the prefilter to
+/// skip far enough to pay for itself
+#define MAX_PREFILTER_BYTES 64
+
+/// The type of the row of one state of the DFA, one cache line
+typedef struct ScanState_S
+{
+    uint64_t bitmap[4];                        ///< bytes that do not go where
+                                               ///< they go from the start
+    uint32_t base[4];                          ///< transition of the first bit
+                                               ///< of each bitmap word
+} __attribute__((aligned(64))) ScanState;
+
+/// The type used to hold a scanner
+typedef struct Scanner_S
+{
+    uint32_t numStates;                        ///< states in the automaton
+    uint32_t firstMatch;                       ///< states from here on end a
+                                               ///< pattern and have no row
+    ScanState* states;                         ///< rows of the other states
+    uint32_t numNext;                          ///< transitions in next
+    uint32_t* next;                            ///< what the bitmaps count into
+    uint32_t rootNext[256];                    ///< transitions of the start
+    unsigned char shuftiLo[16];                ///< buckets of the low nibbles
+    unsigned char shuftiHi[16];                ///< buckets of the high nibbles
+    bool firstByte[256];                       ///< bytes that begin a pattern
+    /// finds the next byte at or after pos that may begin a pattern, NULL if
+    /// the prefilter is not used
+    size_t (*skip)(const struct Scanner_S*, const unsigned char*, size_t, size_t);
+    /// runs the DFA over a buffer, built for the instructions the CPU has
+    bool (*run)(const struct Scanner_S*, const unsigned char*, size_t);
+} Scanner;
+
+/// A node of the trie while it is being built, with its edges in a list
+/// sorted by byte
+typedef struct TrieNode_S
+{
+    uint32_t firstEdge;                        ///< NO_EDGE if it is a leaf
+    bool match;                                ///< a pattern ends here
+} TrieNode;
+
+/// An edge of the trie while it is being built
+typedef struct TrieEdge_S
+{
+    uint32_t child;                            ///< the node it leads to
+    uint32_t next;                             ///< next edge of the parent
+    unsigned char byte;                        ///< the byte it is taken on
+} TrieEdge;
+
+/// A node of the trie once it is laid out in breadth first order, with its
+/// children numbered consecutively
+typedef struct TrieState_S
+{
+    uint64_t bitmap[4];                        ///< bytes with a child
+    uint32_t base[4];                          ///< child of the first bit of
+                                               ///< each bitmap word
+    uint32_t fail;                             ///< state of the longest proper
+                                               ///< suffix that is in the trie
+    bool match;                                ///< a pattern ends here or at
+                                               ///< a suffix
+} TrieState;
+
+
+/// Finds the child of a trie state on a byte.
+/// @param state The state
+/// @param c The byte
+/// @return The child, or 0 if there is no child on c
+static inline uint32_t child_of(const TrieState* state, unsigned char c)
+{
+    uint64_t word = state->bitmap[c >> 6];
+    uint64_t bit = 1ULL << (c & 63);
+
+    if((word & bit) == 0)
+        return 0;
+    return state->base[c >> 6] + __builtin_popcountll(word & (bit - 1));
+}
+
+
+/// Finds the transition of a DFA state on a byte. The transition the bitmap
+/// points at is loaded even when the bit is clear (next has an entry past
+/// the end for that) so that picking one compiles to a conditional move
+/// rather than a branch that random payloads would mispredict.
+/// @param sc The scanner
+/// @param state A state with a row, below firstMatch
+/// @param c The byte
+/// @return The state the byte leads to
+static inline uint32_t next_state(const Scanner* sc, uint32_t state, unsigned char c)
+{
+    const ScanState* row = &sc->states[state];
+    uint64_t word = row->bitmap[c >> 6];
+    uint64_t bit = 1ULL << (c & 63);
+    uint32_t own = sc->next[row->base[c >> 6] + __builtin_popcountll(word & (bit - 1))];
+    uint32_t root = sc->rootNext[c];
+
+    return (word & bit) != 0 ? own : root;
+}
+
+
+/// Skips bytes that do not begin a pattern, one at a time.
+/// @param sc The scanner
+/// @param data The bytes being scanned
+/// @param pos Where to start
+/// @param length The number of bytes
+/// @return The position of the next byte that begins a pattern, or length
+static size_t skip_scalar(const Scanner* sc, const unsigned char* data,
+                          size_t pos, size_t length)
+{
+    while(pos < length && !sc->firstByte[data[pos]])
+        ++pos;
+    return pos;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/// Skips bytes that do not begin a pattern, 16 at a time. A byte is looked
+/// up by each of its nibbles and passes if the two lookups share a bucket.
+/// @param sc The scanner
+/// @param data The bytes being scanned
+/// @param pos Where to start
+/// @param length The number of bytes
+/// @return The position of the next byte that may begin a pattern, or length
+__attribute__((target("ssse3")))
+static size_t skip_ssse3(const Scanner* sc, const unsigned char* data,
+                         size_t pos, size_t length)
+{
+    const __m128i lo = _mm_loadu_si128((const __m128i*)sc->shuftiLo);
+    const __m128i hi = _mm_loadu_si128((const __m128i*)sc->shuftiHi);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    for(; pos + 16 <= length; pos += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(data + pos));
+        __m128i loBuckets = _mm_shuffle_epi8(lo, _mm_and_si128(bytes, nibble));
+        __m128i hiBuckets = _mm_shuffle_epi8(hi,
+                                _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        __m128i none = _mm_cmpeq_epi8(_mm_and_si128(loBuckets, hiBuckets),
+                                      _mm_setzero_si128());
+        unsigned int found = ~_mm_movemask_epi8(none) & 0xffff;
+
+        if(found != 0)
+            return pos + __builtin_ctz(found);
+    }
+    return skip_scalar(sc, data, pos, length);
+}
+#endif
+
+
+/// Runs the DFA over a buffer, one step per byte, stopping at the first
+/// match. Always inlined so each caller gets it built for its own target.
+/// @param sc The scanner
+/// @param data The bytes to search
+/// @param length The number of bytes
+/// @return True if at least one pattern occurs in data
+static inline __attribute__((always_inline))
+bool run_dfa(const Scanner* sc, const unsigned char* data, size_t length)
+{
+    uint32_t state = 0;
+    size_t pos = 0;
+
+    while(pos < length)
+    {
+        if(state != 0)
+            state = next_state(sc, state, data[pos++]);
+        else
+        {
+            // the start state's row is all in rootNext
+            if(sc->skip != NULL)
+            {
+                pos = sc->skip(sc, data, pos, length);
+                if(pos == length)
+                    break;
+            }
+            state = sc->rootNext[data[pos++]];
+        }
+        if(state >= sc->firstMatch)
+            return true;
+    }
+    return false;
+}
+
+
+/// Runs the DFA with the bits counted by a library call.
+/// @param sc The scanner
+/// @param data The bytes to search
+/// @param length The number of bytes
+/// @return True if at least one pattern occurs in data
+static bool run_dfa_generic(const Scanner* sc, const unsigned char* data,
+                            size_t length)
+{
+    return run_dfa(sc, data, length);
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/// Runs the DFA with the bits counted by the popcnt instruction, which
+/// takes one cycle where the library call takes a dozen.
+/// @param sc The scanner
+/// @param data The bytes to search
+/// @param length The number of bytes
+/// @return True if at least one pattern occurs in data
+__attribute__((target("popcnt")))
+static bool run_dfa_popcnt(const Scanner* sc, const unsigned char* data,
+                           size_t length)
+{
+    return run_dfa(sc, data, length);
+}
+#endif
+
+
+/// Sets up the tables used to skip bytes that do not begin a pattern, and
+/// picks the versions of the scan this CPU can run. High
+/// nibbles that begin patterns with the same low nibbles share a bucket.
+/// Past NUM_BUCKETS different sets of low nibbles, a high nibble joins the
+/// bucket closest to its set, which lets more bytes through but never fewer.
+/// @param sc The scanner, whose rootNext is filled in
+static void build_prefilter(Scanner* sc)
+{
+    uint16_t lows[16] = { 0 };
+    uint16_t buckets[NUM_BUCKETS];
+    int numBuckets = 0;
+    int numFirst = 0;
+    int numPassing = 0;
+
+    for(int c = 0; c < 256; ++c)
+    {
+        sc->firstByte[c] = sc->rootNext[c] != 0;
+        if(sc->firstByte[c])
+        {
+            lows[c >> 4] |= 1 << (c & 0xf);
+            ++numFirst;
+        }
+    }
+
+    memset(sc->shuftiLo, 0, sizeof(sc->shuftiLo));
+    memset(sc->shuftiHi, 0, sizeof(sc->shuftiHi));
+    for(int hi = 0; hi < 16; ++hi)
+    {
+        int best = 0;
+        int bestDiff = INT_MAX;
+
+        if(lows[hi] == 0)
+            continue;
+        for(int b = 0; b < numBuckets; ++b)
+        {
+            int diff = __builtin_popcount(buckets[b] ^ lows[hi]);
+            if(diff < bestDiff)
+            {
+                best = b;
+                bestDiff = diff;
+            }
+        }
+        if(bestDiff != 0 && numBuckets < NUM_BUCKETS)
+        {
+            best = numBuckets++;
+            buckets[best] = 0;
+        }
+        buckets[best] |= lows[hi];
+        sc->shuftiHi[hi] |= 1 << best;
+    }
+    for(int b = 0; b < numBuckets; ++b)
+        for(int lo = 0; lo < 16; ++lo)
+            if(buckets[b] & (1 << lo))
+                sc->shuftiLo[lo] |= 1 << b;
+    for(int c = 0; c < 256; ++c)
+        numPassing += (sc->shuftiLo[c & 0xf] & sc->shuftiHi[c >> 4]) != 0;
+
+    sc->skip = numFirst <= MAX_PREFILTER_BYTES ? skip_scalar : NULL;
+    sc->run = run_dfa_generic;
+#if defined(__x86_64__) || defined(__i386__)
+    if(numPassing <= MAX_PREFILTER_BYTES && __builtin_cpu_supports("ssse3"))
+        sc->skip = skip_ssse3;
+    if(__builtin_cpu_supports("popcnt"))
+        sc->run = run_dfa_popcnt;
+#endif
+}
+
+
+/// Adds a pattern to the trie under construction.
+/// @param nodes The nodes so far, with room for the new ones
+/// @param numNodes The number of nodes, updated
+/// @param edges The edges, one less than the nodes
+/// @param pattern The pattern
+/// @param length Its length
+static void insert_pattern(TrieNode* nodes, uint32_t* numNodes, TrieEdge* edges,
+                           const unsigned char* pattern, unsigned int length)
+{
+    uint32_t node = 0;
+
+    for(unsigned int i = 0; i < length; ++i)
+    {
+        // finds the edge on the byte, or where it would go in the list
+        uint32_t* link = &nodes[node].firstEdge;
+        while(*link != NO_EDGE && edges[*link].byte < pattern[i])
+            link = &edges[*link].next;
+
+        if(*link == NO_EDGE || edges[*link].byte != pattern[i])
+        {
+            // the edge into a node has the number of the node less one
+            uint32_t child = (*numNodes)++;
+            TrieEdge* edge = &edges[child - 1];
+
+            nodes[child].firstEdge = NO_EDGE;
+            nodes[child].match = false;
+            edge->child = child;
+            edge->byte = pattern[i];
+            edge->next = *link;
+            *link = child - 1;
+        }
+        node = edges[*link].child;
+    }
+    nodes[node].match = true;
+}
+
+
+/// Lays the trie out in breadth first order, so the children of every state
+/// are numbered consecutively, in byte order.
+/// @param trie Where the states go, one per node
+/// @param numStates The number of nodes
+/// @param nodes The trie
+/// @param edges The edges of the trie
+/// @return False if memory ran out
+static bool lay_out_trie(TrieState* trie, uint32_t numStates,
+                         const TrieNode* nodes, const TrieEdge* edges)
+{
+    uint32_t* queue = malloc(sizeof(uint32_t) * numStates);
+    uint32_t next = 1;
+
+    if(queue == NULL)
+        return false;
+    memset(trie, 0, sizeof(TrieState) * numStates);
+    queue[0] = 0;
+
+    // queue[s] is the trie node of state s
+    for(uint32_t s = 0; s < numStates; ++s)
+    {
+        TrieState* state = &trie[s];
+        uint32_t firstChild = next;
+
+        state->match = nodes[queue[s]].match;
+        for(uint32_t e = nodes[queue[s]].firstEdge; e != NO_EDGE; e = edges[e].next)
+        {
+            state->bitmap[edges[e].byte >> 6] |= 1ULL << (edges[e].byte & 63);
+            queue[next++] = edges[e].child;
+        }
+        for(int w = 0; w < 4; ++w)
+        {
+            state->base[w] = firstChild;
+            firstChild += __builtin_popcountll(state->bitmap[w]);
+        }
+    }
+    free(queue);
+    return true;
+}
+
+
+/// Works out the failure link of every state, in breadth first order so the
+/// links of shallower states are known when they are needed. A state also
+/// matches if the state its failure link leads to matches.
+/// @param trie The trie
+/// @param numStates The number of states
+static void link_failures(TrieState* trie, uint32_t numStates)
+{
+    for(uint32_t s = 0; s < numStates; ++s)
+    {
+        for(int c = 0; c < 256; ++c)
+        {
+            uint32_t child = child_of(&trie[s], c);
+            uint32_t fail = 0;
+
+            if(child == 0)
+                continue;
+            if(s != 0)
+            {
+                // the longest suffix of the parent that can be extended by c
+                fail = trie[s].fail;
+                while(fail != 0 && child_of(&trie[fail], c) == 0)
+                    fail = trie[fail].fail;
+                fail = child_of(&trie[fail], c);
+            }
+            trie[child].fail = fail;
+            trie[child].match |= trie[fail].match;
+        }
+    }
+}
+
+
+/// Folds the failure links into the transitions. The transition of a state
+/// on a byte it has no child on is that of its failure link, whose row is
+/// already built since it is shallower. Only the transitions that differ
+/// from the start state's are stored.
+/// @param sc The scanner whose rows are filled in
+/// @param trie The trie, with its failure links
+/// @return False if memory ran out
+static bool build_dfa(Scanner* sc, const TrieState* trie)
+{
+    uint32_t* number = malloc(sizeof(uint32_t) * sc->numStates);
+    uint32_t numRows = 0;
+    uint32_t numMatches = 0;
+    size_t capacity = 1024;
+
+    if(number == NULL)
+        return false;
+    // the start state can't match, since no pattern is empty
+    for(uint32_t s = 0; s < sc->numStates; ++s)
+        if(!trie[s].match)
+            number[s] = numRows++;
+    for(uint32_t s = 0; s < sc->numStates; ++s)
+        if(trie[s].match)
+            number[s] = numRows + numMatches++;
+    sc->firstMatch = numRows;
+
+    sc->states = aligned_alloc(sizeof(ScanState), sizeof(ScanState) * numRows);
+    sc->next = malloc(sizeof(uint32_t) * capacity);
+    sc->numNext = 0;
+    if(sc->states == NULL || sc->next == NULL)
+    {
+        free(number);
+        return false;
+    }
+    for(int c = 0; c < 256; ++c)
+        sc->rootNext[c] = number[child_of(&trie[0], c)];
+
+    for(uint32_t s = 0; s < sc->numStates; ++s)
+    {
+        ScanState* row = &sc->states[number[s]];
+        uint32_t first = sc->numNext;
+
+        if(trie[s].match)
+            continue;
+        // a row has at most 256 transitions, plus the entry past the end
+        if(sc->numNext + 257 > capacity)
+        {
+            uint32_t* next = realloc(sc->next, sizeof(uint32_t) * capacity * 2);
+            if(next == NULL)
+            {
+                free(number);
+                return false;
+            }
+            sc->next = next;
+            capacity *= 2;
+        }
+
+        memset(row, 0, sizeof(ScanState));
+        for(int c = 0; c < 256; ++c)
+        {
+            uint32_t child = child_of(&trie[s], c);
+            uint32_t to;
+
+            if(child != 0)
+                to = number[child];
+            else if(s == 0)
+                to = 0;
+            else
+                to = next_state(sc, number[trie[s].fail], c);
+            if(to != sc->rootNext[c])
+            {
+                row->bitmap[c >> 6] |= 1ULL << (c & 63);
+                sc->next[sc->numNext++] = to;
+            }
+        }
+        for(int w = 0; w < 4; ++w)
+        {
+            row->base[w] = first;
+            first += __builtin_popcountll(row->bitmap[w]);
+        }
+        sc->next[sc->numNext] = 0;
+    }
+    free(number);
+    return true;
+}
+
+
+/// Creates a scanner by building the trie of the patterns and turning it
+/// into the compressed DFA.
+/// @param patterns The patterns
+/// @param lengths The length of each pattern
+/// @param numPatterns The number of patterns
+/// @return A pointer to the new scanner, NULL if memory ran out
+PayloadScanner create_payload_scanner(const unsigned char* const* patterns,
+                                      const unsigned int* lengths,
+                                      unsigned int numPatterns)
+{
+    Scanner* sc = malloc(sizeof(Scanner));
+    size_t maxNodes = 1;
+    TrieNode* nodes;
+    TrieEdge* edges;
+    TrieState* trie = NULL;
+
+    for(unsigned int i = 0; i < numPatterns; ++i)
+        maxNodes += lengths[i];
+    nodes = malloc(sizeof(TrieNode) * maxNodes);
+    edges = malloc(sizeof(TrieEdge) * maxNodes);
+    if(sc == NULL || nodes == NULL || edges == NULL)
+    {
+        perror("Error creating payload scanner");
+        free(sc);
+        free(nodes);
+        free(edges);
+        return NULL;
+    }
+
+    sc->numStates = 1;
+    sc->states = NULL;
+    sc->next = NULL;
+    nodes[0].firstEdge = NO_EDGE;
+    nodes[0].match = false;
+    for(unsigned int i = 0; i < numPatterns; ++i)
+        insert_pattern(nodes, &sc->numStates, edges, patterns[i], lengths[i]);
+
+    trie = malloc(sizeof(TrieState) * sc->numStates);
+    if(trie != NULL && lay_out_trie(trie, sc->numStates, nodes, edges))
+    {
+        link_failures(trie, sc->numStates);
+        if(build_dfa(sc, trie))
+            build_prefilter(sc);
+        else
+        {
+            free(trie);
+            trie = NULL;
+        }
+    }
+    if(trie == NULL)
+    {
+        perror("Error creating payload scanner");
+        destroy_payload_scanner(sc);
+        sc = NULL;
+    }
+    free(trie);
+    free(nodes);
+    free(edges);
+    return (PayloadScanner) sc;
+}
+
+
+/// Destroys a scanner by freeing its rows and the scanner.
+/// @param scanner The scanner that is to be destroyed
+void destroy_payload_scanner(PayloadScanner scanner)
+{
+    Scanner* sc = scanner;
+
+    free(sc->states);
+    free(sc->next);
+    free(sc);
+}
+
+
+/// Searches a buffer with the DFA built for this CPU.
+/// @param scanner The scanner to use
+/// @param data The bytes to search
+/// @param length The number of bytes
+/// @return True if at least one pattern occurs in data
+bool payload_scanner_match(PayloadScanner scanner, const unsigned char* data,
+                           size_t length)
+{
+    const Scanner* sc = scanner;
+
+    return sc->run(sc, data, length);
+}
+
+
+/// Reports the number of states of the automaton.
+/// @param scanner The scanner to measure
+/// @return The number of states
+unsigned int payload_scanner_states(PayloadScanner scanner)
+{
+    return ((Scanner*)scanner)->numStates;
+}
+
+
+/// Reports the memory used by the automaton.
+/// @param scanner The scanner to measure
+/// @return The size of the rows, the transitions and the start table in bytes
+size_t payload_scanner_size(PayloadScanner scanner)
+{
+    Scanner* sc = scanner;
+
+    return sc->firstMatch * sizeof(ScanState) +
+           (sc->numNext + 1) * sizeof(uint32_t) + sizeof(sc->rootNext);
+}
@@ -0,0 +1,53 @@
+/// \file payloadScan.h
+/// \brief Searches packet payloads for any of a set of byte patterns at once
+/// with an Aho-Corasick automaton.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __PAYLOAD_SCAN_H__
+#define __PAYLOAD_SCAN_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/// The type used by the client to store/use a payload scanner instance
+typedef void* PayloadScanner;
+
+
+/// Compiles a set of patterns into a scanner. The scanner never changes
+/// afterwards; build a new one when the patterns change.
+/// @param patterns The patterns, which may hold any byte values
+/// @param lengths The length of each pattern, none of which may be 0
+/// @param numPatterns The number of patterns
+/// @return A pointer to the new instance, NULL if memory ran out
+PayloadScanner create_payload_scanner(const unsigned char* const* patterns,
+                                      const unsigned int* lengths,
+                                      unsigned int numPatterns);
+
+
+/// Destroys a payload scanner instance and frees its memory.
+/// @param scanner The instance to destroy
+void destroy_payload_scanner(PayloadScanner scanner);
+
+
+/// Checks if any of the patterns occurs in a buffer, in one pass over it.
+/// @param scanner The instance to use
+/// @param data The bytes to search
+/// @param length The number of bytes
+/// @return True if at least one pattern occurs in data
+bool payload_scanner_match(PayloadScanner scanner, const unsigned char* data,
+                           size_t length);
+
+
+/// Reports the number of states of the automaton of a scanner.
+/// @param scanner The instance to measure
+/// @return The number of states, including the start state
+unsigned int payload_scanner_states(PayloadScanner scanner);
+
+
+/// Reports how much memory the automaton of a scanner uses.
+/// @param scanner The instance to measure
+/// @return The size of the state table in bytes
+size_t payload_scanner_size(PayloadScanner scanner);
+
+#endif
@@ -0,0 +1,362 @@
+/// \file perfCounters.c
+/// \brief Counts hardware events such as cycles, instructions and cache
+/// misses for one thread with perf_event_open, split up by the stages that
+/// thread handles each packet in.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+///
+/// Every event is opened into one group, so the kernel schedules them onto
+/// the processor together and one read of the group leader returns all of
+/// the counts for exactly the same stretch of time. Ending a stage reads the
+/// group and adds the difference from the previous read to that stage.
+///
+/// That read is a system call, and the counters count it too. Its cost is
+/// measured when the counters are started and is taken back off each stage,
+/// once per packet, when the counts are printed.
+
+/// needed for syscall
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "perfCounters.h"
+#include "statCount.h"
+
+/// number of back to back reads the cost of one read is averaged over
+#define CALIBRATION_READS 64
+
+/// the config of a cache event that counts read misses in one cache
+#define CACHE_READ_MISSES(cache) ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+                                  PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+/// the values read from the group: how many there are, the times it was
+/// enabled and running, then one count per event
+#define READ_HEADER 3
+
+
+/// The events counted, in the order they are opened and printed
+typedef enum PerfEvent_E
+{
+    EVENT_CYCLES,
+    EVENT_INSTRUCTIONS,
+    EVENT_L1D_MISSES,
+    EVENT_LLC_MISSES,
+    EVENT_BRANCH_MISSES,
+    EVENT_KERNEL_CYCLES,
+    EVENT_TASK_CLOCK,
+    NUM_EVENTS
+} PerfEvent;
+
+/// The type of the description of one event
+typedef struct EventSpec_S
+{
+    unsigned int type;                         ///< perf_event_attr type
+    unsigned long long config;                 ///< perf_event_attr config
+    bool kernelOnly;                           ///< counts only in the kernel
+    const char* name;                          ///< its column heading
+} EventSpec;
+
+/// how to open each event. Software events go last, so that the group
+/// leader is a hardware event whenever there is one.
+static const EventSpec eventSpecs[NUM_EVENTS] =
+{
+    [EVENT_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+                       false, "cycles" },
+    [EVENT_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,
+                             false, "instrs" },
+    [EVENT_L1D_MISSES] = { PERF_TYPE_HW_CACHE,
+                           CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_L1D),
+                           false, "L1D-miss" },
+    [EVENT_LLC_MISSES] = { PERF_TYPE_HW_CACHE,
+                           CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_LL),
+                           false, "LLC-miss" },
+    [EVENT_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES,
+                              false, "br-miss" },
+    [EVENT_KERNEL_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+                              true, "sys-cyc" },
+    [EVENT_TASK_CLOCK] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,
+                           false, "ns" }
+};
+
+/// names of the stages as printed
+static const char* const stageNames[NUM_PERF_STAGES] =
+{
+    [PERF_STAGE_READ] = "read",
+    [PERF_STAGE_FILTER] = "filter",
+    [PERF_STAGE_WRITE] = "write"
+};
+
+/// The type used to hold the counters of one thread
+typedef struct Perf_S
+{
+    int fds[NUM_EVENTS];                       ///< each event, -1 if not open
+    int groupFd;                               ///< group leader, -1 until
+                                               ///< started
+    unsigned int numOpen;                      ///< events in the group
+    PerfEvent order[NUM_EVENTS];               ///< event of each value read
+    unsigned long long last[NUM_EVENTS];       ///< counts when the previous
+                                               ///< stage ended
+    bool countKernel;                          ///< false if only user space
+                                               ///< is counted
+    unsigned long long overhead[NUM_EVENTS];   ///< counted by one read
+    atomic_uint events;                        ///< bit per event counted, set
+                                               ///< once everything above is
+    atomic_ulong totals[NUM_PERF_STAGES][NUM_EVENTS]; ///< counted per stage
+    atomic_ulong packets;                      ///< last stages ended
+    atomic_ullong timeEnabled;                 ///< ns the group was enabled
+    atomic_ullong timeRunning;                 ///< ns it was on a processor
+} Perf;
+
+
+/// Opens one event for the calling thread, on whichever processor it runs.
+/// @param spec The event to open
+/// @param countKernel false to count only user space
+/// @param groupFd The group leader, or -1 to make this event the leader
+/// @return The new descriptor, or -1 with errno set
+static int open_event(const EventSpec* spec, bool countKernel, int groupFd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = spec->type;
+    attr.config = spec->config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = !countKernel;
+    attr.exclude_user = spec->kernelOnly;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd,
+                   PERF_FLAG_FD_CLOEXEC);
+}
+
+
+/// Reads every count in the group at once.
+/// @param perf The instance to read
+/// @param counts Where to store the counts, indexed by event
+/// @return true if successful
+static bool read_group(Perf* perf, unsigned long long* counts)
+{
+    unsigned long long values[READ_HEADER + NUM_EVENTS];
+    ssize_t size = (READ_HEADER + perf->numOpen) * sizeof(values[0]);
+
+    if(read(perf->groupFd, values, size) != size)
+        return false;
+    for(unsigned int i = 0; i < perf->numOpen; ++i)
+        counts[perf->order[i]] = values[READ_HEADER + i];
+    atomic_store_explicit(&perf->timeEnabled, values[1], memory_order_relaxed);
+    atomic_store_explicit(&perf->timeRunning, values[2], memory_order_relaxed);
+    return true;
+}
+
+
+/// Creates a perf counters instance. Nothing is counted until it is started.
+/// @return A pointer to the new instance, NULL if memory ran out
+PerfCounters create_perf_counters(void)
+{
+    Perf* perf = calloc(1, sizeof(Perf));
+
+    if(perf == NULL)
+        return NULL;
+    for(int event = 0; event < NUM_EVENTS; ++event)
+        perf->fds[event] = -1;
+    perf->groupFd = -1;
+    return perf;
+}
+
+
+/// Destroys a perf counters instance by closing its counters and freeing it.
+/// @param perf The instance that is to be destroyed
+void destroy_perf_counters(PerfCounters perf)
+{
+    Perf* pPerf = perf;
+
+    for(int event = 0; event < NUM_EVENTS; ++event)
+    {
+        if(pPerf->fds[event] != -1)
+            close(pPerf->fds[event]);
+    }
+    free(pPerf);
+}
+
+
+/// Opens every event it can into one group for the calling thread, then
+/// measures what one read of the group counts.
+/// @param perf The instance to start
+/// @return true if at least one event is being counted, otherwise errno says
+/// why the last one failed
+bool start_perf_counters(PerfCounters perf)
+{
+    Perf* pPerf = perf;
+    unsigned long long first[NUM_EVENTS];
+    unsigned int mask = 0;
+    int error = 0;
+
+    pPerf->countKernel = true;
+    for(int event = 0; event < NUM_EVENTS; ++event)
+    {
+        const EventSpec* spec = &eventSpecs[event];
+        if(spec->kernelOnly && !pPerf->countKernel)
+            continue;
+        int fd = open_event(spec, pPerf->countKernel, pPerf->groupFd);
+        // an unprivileged user may usually still count its own user space,
+        // which can only be decided before the first event is in the group
+        if(fd == -1 && (errno == EACCES || errno == EPERM) &&
+           pPerf->countKernel && pPerf->groupFd == -1)
+        {
+            pPerf->countKernel = false;
+            if(spec->kernelOnly)
+                continue;
+            fd = open_event(spec, false, -1);
+        }
+        // events the processor has no counter for are left out
+        if(fd == -1)
+        {
+            error = errno;
+            continue;
+        }
+        pPerf->fds[event] = fd;
+        if(pPerf->groupFd == -1)
+            pPerf->groupFd = fd;
+        pPerf->order[pPerf->numOpen++] = event;
+        mask |= 1u << event;
+    }
+    if(pPerf->groupFd == -1)
+    {
+        errno = error;
+        return false;
+    }
+
+    // measures what a read adds to the stage it ends
+    if(!read_group(pPerf, first))
+        return false;
+    for(int i = 0; i < CALIBRATION_READS; ++i)
+        read_group(pPerf, pPerf->last);
+    for(unsigned int i = 0; i < pPerf->numOpen; ++i)
+    {
+        PerfEvent event = pPerf->order[i];
+        pPerf->overhead[event] = (pPerf->last[event] - first[event]) /
+                                  CALIBRATION_READS;
+    }
+    atomic_store_explicit(&pPerf->events, mask, memory_order_release);
+    return true;
+}
+
+
+/// Reads the group and adds what was counted since the previous read to a
+/// stage.
+/// @param perf The instance to use
+/// @param stage The stage that just ended
+void end_perf_stage(PerfCounters perf, PerfStage stage)
+{
+    Perf* pPerf = perf;
+    unsigned long long now[NUM_EVENTS];
+
+    if(pPerf->groupFd == -1 || !read_group(pPerf, now))
+        return;
+    for(unsigned int i = 0; i < pPerf->numOpen; ++i)
+    {
+        PerfEvent event = pPerf->order[i];
+        add_count(&pPerf->totals[stage][event], now[event] - pPerf->last[event]);
+        pPerf->last[event] = now[event];
+    }
+    if(stage == NUM_PERF_STAGES - 1)
+        add_count(&pPerf->packets, 1);
+}
+
+
+/// Prints one row of the table: a count of each event per packet, and the
+/// instructions per cycle.
+/// @param out The stream to print to
+/// @param name The name of the row
+/// @param perPacket The count of each event per packet
+/// @param mask Bit per event that was counted, the others are printed as -
+static void print_row(FILE* out, const char* name, const double* perPacket,
+                      unsigned int mask)
+{
+    fprintf(out, "perf: %-7s", name);
+    for(int event = 0; event < NUM_EVENTS; ++event)
+    {
+        if(mask & 1u << event)
+            fprintf(out, " %9.1f", perPacket[event]);
+        else
+            fprintf(out, " %9s", "-");
+        if(event == EVENT_INSTRUCTIONS)
+        {
+            if((mask & 1u << EVENT_CYCLES) && (mask & 1u << EVENT_INSTRUCTIONS) &&
+               perPacket[EVENT_CYCLES] > 0)
+                fprintf(out, " %5.2f",
+                        perPacket[EVENT_INSTRUCTIONS] / perPacket[EVENT_CYCLES]);
+            else
+                fprintf(out, " %5s", "-");
+        }
+    }
+    fputc('\n', out);
+}
+
+
+/// Prints the counts per packet of each stage with the cost of a read taken
+/// off, their total, and what one read counts. A count no more than that
+/// cost is printed as -, since what is left of it is only noise.
+/// @param perf The instance to print
+/// @param out The stream to print to
+void print_perf_counters(PerfCounters perf, FILE* out)
+{
+    Perf* pPerf = perf;
+    unsigned int mask = atomic_load_explicit(&pPerf->events, memory_order_acquire);
+    unsigned long packets = atomic_load(&pPerf->packets);
+    unsigned long long enabled = atomic_load(&pPerf->timeEnabled);
+    unsigned long long running = atomic_load(&pPerf->timeRunning);
+    double perPacket[NUM_EVENTS];
+    double total[NUM_EVENTS] = { 0 };
+    unsigned int totalMask = 0;
+
+    if(mask == 0)
+    {
+        fputs("perf: no events are being counted\n", out);
+        return;
+    }
+    fprintf(out, "perf: %lu packets, %s counted, counters ran %.0f%% of the "
+            "time, one read of them taken off each stage\n", packets,
+            pPerf->countKernel ? "user and kernel" : "only user space",
+            enabled > 0 ? 100.0 * running / enabled : 0.0);
+    if(packets == 0)
+        return;
+
+    fprintf(out, "perf: %-7s", "stage");
+    for(int event = 0; event < NUM_EVENTS; ++event)
+    {
+        fprintf(out, " %9s", eventSpecs[event].name);
+        if(event == EVENT_INSTRUCTIONS)
+            fprintf(out, " %5s", "IPC");
+    }
+    fputc('\n', out);
+
+    for(int stage = 0; stage < NUM_PERF_STAGES; ++stage)
+    {
+        unsigned int stageMask = 0;
+
+        for(int event = 0; event < NUM_EVENTS; ++event)
+        {
+            // each stage of each packet ended with one read of the counters
+            double count = (double)atomic_load(&pPerf->totals[stage][event]) -
+                           (double)pPerf->overhead[event] * packets;
+            perPacket[event] = count > 0 ? count / packets : 0;
+            total[event] += perPacket[event];
+            if(count > 0)
+                stageMask |= 1u << event;
+        }
+        stageMask &= mask;
+        totalMask |= stageMask;
+        print_row(out, stageNames[stage], perPacket, stageMask);
+    }
+    print_row(out, "total", total, totalMask);
+
+    for(int event = 0; event < NUM_EVENTS; ++event)
+        perPacket[event] = pPerf->overhead[event];
+    print_row(out, "reads", perPacket, mask);
+}
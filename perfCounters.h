@@ -0,0 +1,62 @@
+/// \file perfCounters.h
+/// \brief Counts hardware events such as cycles, instructions and cache
+/// misses for one thread with perf_event_open, split up by the stages that
+/// thread handles each packet in.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/// The stages a packet is handled in, in the order they happen
+typedef enum PerfStage_E
+{
+    PERF_STAGE_READ,                 ///< reading it from the input pipe
+    PERF_STAGE_FILTER,               ///< deciding whether it gets through
+    PERF_STAGE_WRITE,                ///< writing, counting and tapping it
+    NUM_PERF_STAGES
+} PerfStage;
+
+
+/// The type used by the client to store/use a perf counters instance
+typedef void* PerfCounters;
+
+
+/// Creates a perf counters instance. Nothing is counted until it is started.
+/// @return A pointer to the new instance, NULL if memory ran out
+PerfCounters create_perf_counters(void);
+
+
+/// Destroys a perf counters instance, closing its counters.
+/// @param perf The instance to destroy
+void destroy_perf_counters(PerfCounters perf);
+
+
+/// Opens the counters for the calling thread and starts counting. Events the
+/// processor or the kernel do not support are left out, and only user space
+/// is counted when the kernel does not allow counting it too.
+/// @param perf The instance to start
+/// @return true if at least one event is being counted, otherwise errno says
+/// why the last one failed
+bool start_perf_counters(PerfCounters perf);
+
+
+/// Adds what was counted since the previous stage ended to a stage. Ending
+/// the last stage counts one packet. Only the thread that started the
+/// counters may end stages; it does nothing if they could not be started.
+/// @param perf The instance to use
+/// @param stage The stage that just ended
+void end_perf_stage(PerfCounters perf, PerfStage stage);
+
+
+/// Prints what was counted per packet in each stage, and the instructions
+/// per cycle. A count no more than what reading the counters adds is printed
+/// as -. Any thread may print while the counters are in use.
+/// @param perf The instance to print
+/// @param out The stream to print to
+void print_perf_counters(PerfCounters perf, FILE* out);
+
+#endif
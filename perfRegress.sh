@@ -0,0 +1,461 @@
+#!/bin/bash
+#
+# perfRegress.sh compares the hardware counters of firewall builds on the
+# same synthetic trace. Each build is run with --perf on config1.txt, or the
+# configuration of the scenario, while the trace is written straight into
+# ToFirewall, and the run with the fewest
+# cycles per packet (or ns, without hardware counters) is kept. Every build
+# after the first gets a second line per stage with the change from the
+# first. The counters of the filter that the scenario is about are printed
+# under the table of each build. A build may be followed by settings to add
+# to its configuration, each after a +, e.g. ./firewall+JIT_COMPILE.
+#
+# usage: ./perfRegress.sh [-r runs] [-c copies] [-t percent] [-s scenario]
+#                         [-n addresses] [-f config] [-S seed] [-k]
+#                         firewall[+SETTING]...
+#   -r runs      runs of each build, default 3
+#   -c copies    copies of the 256 packet trace to send, default 400; the
+#                other scenarios send as many packets, all different
+#   -t percent   exit 1 if the total per packet of any build is more than
+#                percent worse than the first build
+#   -s scenario  the trace to send, default mixed
+#                mixed   web, blocked ports, DNS, pings and a blocked address
+#                bloom   adds -n BLOCK_IP_ADDR settings; web traffic from
+#                        random addresses, 1 in 64 of them blocked
+#                payload adds 1000 BLOCK_PAYLOAD patterns; web traffic with
+#                        1400 byte payloads, 1 in 64 of them holding one
+#                frag    first fragments from random addresses that never
+#                        get the rest, and every 4th a datagram in two
+#                        fragments
+#                fuzz    random rules in place of the configuration, and
+#                        packets of any protocol, fragment and length from
+#                        addresses and to ports the rules name
+#   -n addresses blocked addresses of the bloom scenario, default 10000
+#   -f config    the configuration the scenario adds its settings to,
+#                default config1.txt. The scenarios other than mixed send to
+#                its LOCAL_NET.
+#   -S seed      seed of the random addresses and packets, below a million,
+#                default 1. A seed gives the same trace with every awk.
+#   -k           exit 1 if a run of any build lets through other packets
+#                than the first run of the first build
+#
+# e.g. git stash; make; cp firewall /tmp/fw.old; git stash pop; make
+#      ./perfRegress.sh /tmp/fw.old ./firewall
+#      ./perfRegress.sh -s bloom ./firewall
+#      ./perfRegress.sh -s bloom -n 1000000 ./firewall ./firewall+NO_IP_BLOOM
+#      ./perfRegress.sh -s payload ./firewall
+#      ./perfRegress.sh -s frag -c 4000 ./firewall
+#      ./perfRegress.sh -s fuzz -S 7 -k ./firewall ./firewall+JIT_COMPILE
+
+RUNS=3
+COPIES=400
+THRESHOLD=
+SCENARIO=mixed
+ADDRESSES=10000
+BASE_CONFIG=config1.txt
+SEED=1
+CHECK=false
+
+while getopts "r:c:t:s:n:f:S:k" opt; do
+    case $opt in
+        r) RUNS=$OPTARG ;;
+        c) COPIES=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        s) SCENARIO=$OPTARG ;;
+        n) ADDRESSES=$OPTARG ;;
+        f) BASE_CONFIG=$OPTARG ;;
+        S) SEED=$OPTARG ;;
+        k) CHECK=true ;;
+        *) exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-r runs] [-c copies] [-t percent] [-s scenario]" \
+         "[-n addresses] [-f config] [-S seed] [-k] firewall[+SETTING]..." >&2
+    exit 2
+fi
+
+# the filter counters printed for each scenario, then which checks ran
+case ${SCENARIO} in
+    mixed|fuzz) STATS= ;;
+    bloom)      STATS='^blocked ip|^bloom' ;;
+    payload)    STATS='payload' ;;
+    frag)       STATS='^fragment' ;;
+    *)          echo "$0: unknown scenario ${SCENARIO}" >&2; exit 2 ;;
+esac
+STATS="${STATS:+${STATS}|}^checks|^native code"
+
+WORK=$(mktemp -d)
+trap 'rm -rf ${WORK}' EXIT
+mkfifo ${WORK}/ToFirewall ${WORK}/FromFirewall
+CONFIG=${WORK}/config
+
+# bytes prints its arguments as escapes of single bytes for printf
+bytes() {
+    for b in "$@"; do printf '\\x%02x' "$b"; done
+}
+
+# packet prints one record of the trace: the length as the pipe expects it
+# then a 20 byte IPv4 header and a TCP, UDP or ICMP header.
+# args: protocol srcIp dstIp srcPort|icmpType dstPort
+packet() {
+    local proto=$1 src=(${2//./ }) dst=(${3//./ }) a=$4 b=$5 len l4
+    case $proto in
+        6)  l4=$(bytes $((a >> 8)) $((a & 255)) $((b >> 8)) $((b & 255)) \
+                       0 0 0 0 0 0 0 0 0x50 2 0 0 0 0 0 0) ;;
+        17) l4=$(bytes $((a >> 8)) $((a & 255)) $((b >> 8)) $((b & 255)) \
+                       0 8 0 0) ;;
+        1)  l4=$(bytes $a 0 0 0 0 0 0 0) ;;
+    esac
+    len=$((20 + ${#l4} / 4))
+    printf "$(bytes $len 0 0 0)$(bytes 0x45 0 0 $len 0 0 0 0 64 $proto 0 0 \
+              ${src[@]} ${dst[@]})${l4}"
+}
+
+# make_trace writes 256 packets, mostly inbound to config1.txt's local net:
+# web and blocked TCP ports, DNS, pings and replies, the blocked address and
+# some outbound traffic, then repeats them COPIES times.
+make_trace() {
+    local i ports=(80 443 22 23 8080 25)
+    for i in $(seq 0 255); do
+        case $((i % 8)) in
+            0|1|2|3) packet 6 10.1.$((i % 7)).$i 69.207.190.$i \
+                            $((40000 + i)) ${ports[$((i % 6))]} ;;
+            4) packet 17 10.2.0.$i 69.207.190.$i $((40000 + i)) 53 ;;
+            5) packet 1 10.3.0.$i 69.207.190.$i $(( i & 16 ? 0 : 8 )) 0 ;;
+            6) packet 6 216.17.111.135 69.207.190.$i $((40000 + i)) 80 ;;
+            7) packet 6 69.207.190.$i 93.184.216.$i $((40000 + i)) 443 ;;
+        esac
+    done > ${WORK}/block
+    for i in $(seq 1 ${COPIES}); do cat ${WORK}/block; done > ${WORK}/trace
+}
+
+# generate prints the settings a scenario adds to the configuration, or its
+# trace, which is COPIES times 256 packets. The random numbers come from a
+# Park-Miller generator rather than rand(), whose sequence differs between
+# awks, and both parts draw the blocked addresses first so that they agree.
+# args: settings|trace
+generate() {
+    LC_ALL=C awk -v scenario=${SCENARIO} -v part=$1 -v seed=${SEED} \
+                 -v packets=$((COPIES * 256)) -v addresses=${ADDRESSES} \
+                 -v localNet=${LOCAL_NET} \
+                 -v localSize=${LOCAL_SIZE} '
+        # a random integer from 0 to n - 1
+        function rnd(n) {
+            seed = seed * 48271 % 2147483647
+            return int(seed / 2147483647 * n)
+        }
+        # a random unicast address outside the local net
+        function remote(  a) {
+            do a = (1 + rnd(223)) * 16777216 + rnd(16777216)
+            while (a >= localNet && a < localNet + localSize)
+            return a
+        }
+        # a local address, the same for every 256th packet
+        function local(i) {
+            return localNet + i % (localSize < 256 ? localSize : 256)
+        }
+        function dotted(a) {
+            return sprintf("%d.%d.%d.%d", int(a / 16777216),
+                           int(a / 65536) % 256, int(a / 256) % 256, a % 256)
+        }
+        function u16(v) { return chr[int(v / 256) % 256] chr[v % 256] }
+        function u32(v) { return u16(int(v / 65536)) u16(v % 65536) }
+        # a TCP header from port a to port b, without options: 80 is the
+        # length of 5 words, as mawk has no hex constants
+        function tcp(a, b) {
+            return u16(a) u16(b) u32(0) u32(0) chr[80] chr[2] u16(0) u32(0)
+        }
+        # n random bytes
+        function noise(n,  s) {
+            for (s = ""; n > 0; --n)
+                s = s chr[rnd(256)]
+            return s
+        }
+        # n random lower case letters, and spaces when words is set
+        function text(n, words,  letters, s) {
+            letters = "abcdefghijklmnopqrstuvwxyz" (words ? " " : "")
+            for (s = ""; n > 0; --n)
+                s = s substr(letters, 1 + rnd(length(letters)), 1)
+            return s
+        }
+        # prints one record: the length as the pipe expects it, then an
+        # IPv4 header with the fragment field frag and the rest; 69 is
+        # version 4 and 5 words long. The total length in the header is
+        # ipLen, or the length of the record.
+        function packet(proto, src, dst, id, frag, rest, ipLen,  len) {
+            len = 20 + length(rest)
+            printf "%s", chr[len % 256] chr[int(len / 256)] chr[0] chr[0] \
+                   chr[69] chr[0] u16(ipLen != "" ? ipLen : len) u16(id) \
+                   u16(frag) chr[64] chr[proto] u16(0) u32(src) u32(dst) rest
+        }
+        # writes random rules, mostly for the well known ports and for
+        # addresses in or near the local net
+        function fuzz_rules(  bits, i) {
+            bits = 8 + rnd(23)
+            localSize = 2 ^ (32 - bits)
+            localNet = (1 + rnd(223)) * 16777216 + rnd(16777216)
+            localNet -= localNet % localSize
+            split("22 23 25 53 80 443 8080", known)
+            numPorts = rnd(6)
+            for (i = 0; i < numPorts; ++i)
+                ports[i] = rnd(2) ? known[1 + rnd(7)] : 1 + rnd(65535)
+            numAddrs = rnd(9)
+            for (i = 0; i < numAddrs; ++i)
+                addrs[i] = rnd(3) ? remote() : localNet + rnd(localSize)
+            if (part != "settings")
+                return
+            print "LOCAL_NET: " dotted(localNet + rnd(localSize)) "/" bits
+            for (i = 0; i < numPorts; ++i)
+                print "BLOCK_INBOUND_TCP_PORT: " ports[i]
+            if (rnd(2))
+                print "BLOCK_PING_REQ"
+            for (i = 0; i < numAddrs; ++i)
+                print "BLOCK_IP_ADDR: " dotted(addrs[i]) "/32"
+        }
+        # a local address, usually one of the first four, a blocked one or
+        # a remote one
+        function fuzz_addr(  r) {
+            r = rnd(8)
+            if (r < 2)
+                return localNet + rnd(localSize < 4 ? localSize : 4)
+            if (r < 4)
+                return localNet + rnd(localSize)
+            if (r < 6 && numAddrs > 0)
+                return addrs[rnd(numAddrs)]
+            return remote()
+        }
+        # prints a random packet: some are fragments, some are cut short and
+        # some have a total length that does not match what was received.
+        # Half of the later fragments belong to the last first fragment.
+        function fuzz_packet(  proto, src, dst, id, port, rest, frag, r) {
+            r = rnd(8)
+            proto = r < 4 ? 6 : r < 6 ? 1 : r < 7 ? 17 : rnd(256)
+            src = fuzz_addr()
+            dst = fuzz_addr()
+            id = rnd(16)
+            port = rnd(2) && numPorts > 0 ? ports[rnd(numPorts)] : rnd(65536)
+            if (proto == 6)
+                rest = tcp(rnd(65536), port)
+            else if (proto == 1)
+                rest = chr[rnd(4) ? 8 * rnd(2) : rnd(256)] noise(7)
+            else
+                rest = noise(8)
+            rest = rest noise(rnd(4) ? 0 : rnd(32))
+            # first and later fragments, where 8192 is more fragments, and
+            # some with 16384, that may not be split
+            r = rnd(16)
+            if (r == 0) {
+                frag = 8192
+                firstProto = proto
+                firstSrc = src
+                firstDst = dst
+                firstId = id
+            }
+            else if (r == 1) {
+                frag = 8192 * rnd(2) + 1 + rnd(8)
+                if (rnd(2) && firstProto != "") {
+                    proto = firstProto
+                    src = firstSrc
+                    dst = firstDst
+                    id = firstId
+                }
+            }
+            else
+                frag = r == 2 ? 16384 : 0
+            if (!rnd(8))
+                rest = substr(rest, 1, rnd(length(rest)))
+            packet(proto, src, dst, id, frag, rest,
+                   rnd(16) ? "" : 20 + rnd(40))
+        }
+        BEGIN {
+            for (i = 0; i < 256; ++i)
+                chr[i] = sprintf("%c", i)
+            # nearby seeds would draw nearby numbers, so each is spread out
+            # and then skips a number of draws of its own
+            seed = seed * 1327217885 % 2147483647
+            if (seed == 0)
+                seed = 1
+            for (i = seed % 32; i >= 0; --i)
+                rnd(1)
+            if (scenario == "bloom") {
+                # the trace keeps about 1024 of the blocked addresses to
+                # send from, so that millions of them fit in memory
+                step = addresses > 1024 ? int(addresses / 1024) : 1
+                for (i = 0; i < addresses; ++i) {
+                    a = remote()
+                    if (part == "settings")
+                        print "BLOCK_IP_ADDR: " dotted(a) "/32"
+                    else if (i % step == 0)
+                        blocked[numBlocked++] = a
+                }
+                if (part == "settings")
+                    exit
+                for (i = 0; i < packets; ++i)
+                    packet(6, i % 64 ? remote() : blocked[rnd(numBlocked)],
+                           local(i), i % 65536, 0,
+                           tcp(1024 + rnd(64512), 443))
+            }
+            else if (scenario == "payload") {
+                for (i = 0; i < 1000; ++i) {
+                    patterns[i] = text(8 + rnd(9))
+                    if (part == "settings")
+                        print "BLOCK_PAYLOAD: " patterns[i]
+                }
+                if (part == "settings")
+                    exit
+                # the first payload holds a pattern, the others do not
+                for (i = 0; i < 64; ++i)
+                    payloads[i] = text(1400, 1)
+                i = rnd(1380)
+                p = patterns[rnd(1000)]
+                payloads[0] = substr(payloads[0], 1, i) p \
+                              substr(payloads[0], i + 1 + length(p))
+                for (i = 0; i < packets; ++i)
+                    packet(6, remote(), local(i), i % 65536, 0,
+                           tcp(1024 + rnd(64512), 443) payloads[i % 64])
+            }
+            else if (scenario == "frag") {
+                # a first fragment holds the TCP header and 4 bytes, which
+                # is 3 units of the fragment offset, 8192 is more fragments
+                for (i = 0; i < packets; ++i) {
+                    src = remote()
+                    dst = local(i)
+                    id = i % 65536
+                    packet(6, src, dst, id, 8192,
+                           tcp(1024 + rnd(64512), 443) text(4))
+                    # the rest of every 4th, which counts as a packet too
+                    if (i % 4 == 0 && ++i < packets)
+                        packet(6, src, dst, id, 3, text(16))
+                }
+            }
+            else if (scenario == "fuzz") {
+                fuzz_rules()
+                if (part == "settings")
+                    exit
+                for (i = 0; i < packets; ++i)
+                    fuzz_packet()
+            }
+        }'
+}
+
+# run_build runs one build over the trace and prints its perf table. The
+# checksum of the packets it let through is left in ${WORK}/sum.
+# args: firewall config
+run_build() {
+    local firewall reader writer
+    (cd ${WORK} && exec "$1" --perf "$2" < /dev/null > ${WORK}/out 2>&1) &
+    firewall=$!
+    cksum < ${WORK}/FromFirewall > ${WORK}/sum &
+    reader=$!
+    cat ${WORK}/trace > ${WORK}/ToFirewall &
+    writer=$!
+    # one that fails, such as on a bad configuration, may never open the
+    # pipes that the others wait for
+    wait ${firewall} || kill ${reader} ${writer} 2> /dev/null
+    wait
+    grep '^perf: ' ${WORK}/out
+}
+
+# print_stats prints the filter counters of the scenario from the best run
+# of a build, and for payload how fast the filter stage went through them
+print_stats() {
+    grep -E "${STATS}" ${WORK}/best.out
+    [ ${SCENARIO} = payload ] && awk '$2 == "filter" && $NF != "-" {
+        printf "filter stage: %.2f GB/s of payload\n", 1400 / $NF }' ${WORK}/best
+}
+
+# the first address and the size of the local net, for the generator
+read LOCAL_NET LOCAL_SIZE < <(awk -F '[ ./]+' '/^LOCAL_NET/ {
+    addr = (($2 * 256 + $3) * 256 + $4) * 256 + $5; size = 2 ^ (32 - $6)
+    printf "%.0f %.0f\n", addr - addr % size, size }' "${BASE_CONFIG}")
+if [ ${SCENARIO} = mixed ]; then
+    make_trace
+    cp "${BASE_CONFIG}" ${CONFIG}
+elif [ ${SCENARIO} = fuzz ]; then
+    generate trace > ${WORK}/trace
+    generate settings > ${CONFIG}
+else
+    generate trace > ${WORK}/trace
+    (cat "${BASE_CONFIG}"; echo; generate settings) > ${CONFIG}
+fi
+echo "trace: $((COPIES * 256)) packets of ${SCENARIO}, best of ${RUNS} runs"
+
+status=0
+first=
+for build in "$@"; do
+    bin=$(realpath "${build%%+*}")
+    settings=${build#"${build%%+*}"}
+    # the settings after the build's name, one per line
+    (cat ${CONFIG}; echo; tr '+' '\n' <<< "${settings#+}") > ${CONFIG}.build
+    best=
+    # a build from before --perf would exit without ever opening the pipes
+    if ! "$bin" 2>&1 | grep -q -- --perf; then
+        echo "${build}: has no --perf option" >&2
+        status=1
+        continue
+    fi
+    for run in $(seq 1 ${RUNS}); do
+        run_build "$bin" ${CONFIG}.build > ${WORK}/run
+        if [ ! -f ${WORK}/expected ]; then
+            cp ${WORK}/sum ${WORK}/expected
+        elif ${CHECK} && ! cmp -s ${WORK}/sum ${WORK}/expected; then
+            echo "${build}: run ${run} let through other packets than $1" >&2
+            status=1
+        fi
+        # cycles of the total row, or ns when there are no hardware counters
+        cost=$(awk '$2 == "total" { print ($3 != "-" ? $3 : $NF) }' ${WORK}/run)
+        if [ -z "$best" ] || awk -v a="$cost" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+            best=$cost
+            cp ${WORK}/run ${WORK}/best
+            cp ${WORK}/out ${WORK}/best.out
+        fi
+    done
+    if [ -z "$best" ]; then
+        echo "${build}: no perf output" >&2
+        status=1
+        continue
+    fi
+
+    echo ""
+    echo "== ${build}"
+    if [ -z "$first" ]; then
+        first=${WORK}/first
+        cp ${WORK}/best ${first}
+        grep -v '^perf: [0-9]' ${first} | cut -c7-
+        print_stats
+        continue
+    fi
+    # prints each stage, and under it the change of each column from the
+    # same stage of the first build
+    awk -v threshold="${THRESHOLD}" '
+        FNR == NR { if ($2 ~ /^(read|filter|write|total)$/) base[$2] = $0; next }
+        $2 == "stage" { print substr($0, 7); next }
+        $2 ~ /^(read|filter|write|total|reads)$/ {
+            print substr($0, 7)
+            if (!($2 in base)) next
+            split(base[$2], old)
+            line = sprintf("  %-6s", "change")
+            for (i = 3; i <= NF; ++i) {
+                # the IPC column is narrower and changes by difference
+                width = (i == 5) ? 5 : 9
+                if ($i == "-" || old[i] == "-" || (i != 5 && old[i] == 0))
+                    line = line sprintf(" %*s", width, "-")
+                else if (i == 5)
+                    line = line sprintf(" %+5.2f", $i - old[i])
+                else
+                    line = line sprintf(" %+8.1f%%", 100 * ($i - old[i]) / old[i])
+            }
+            print line
+            # cycles if they were counted, otherwise ns
+            col = ($3 != "-") ? 3 : NF
+            if ($2 == "total" && threshold != "" && old[col] > 0 &&
+                100 * ($col - old[col]) / old[col] > threshold)
+                worse = 1
+        }
+        END { exit worse }' ${first} ${WORK}/best || status=1
+    print_stats
+done
+
+exit ${status}
@@ -0,0 +1,340 @@
+/// \file pktTap.c
+/// \brief Mirrors a sample of the packets seen by the firewall to a
+/// pcap formatted file or named pipe without slowing down the firewall.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+///
+/// The filter thread hands packets to the tap through a single producer,
+/// single consumer ring. A dedicated writer thread empties the ring into
+/// the output file, so a slow reader of the output only causes samples to
+/// be dropped and never holds up the filter thread. A reader of a named pipe
+/// may also go away and come back; samples taken in between are dropped and
+/// the next reader gets a pcap stream of its own.
+
+/// posix needed for clock_gettime, nanosleep and poll
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "pktTap.h"
+
+/// number of packets the ring can hold (must be a power of two)
+#define TAP_RING_SLOTS 256
+
+/// size of a cache line, used to keep the producer and consumer apart
+#define CACHE_LINE 64
+
+/// milliseconds the writer waits for its output to become writable
+#define TAP_POLL_MS 100
+
+/// pcap magic number for microsecond resolution timestamps
+#define PCAP_MAGIC 0xa1b2c3d4
+
+/// pcap link type for raw IPv4/IPv6 packets with no link layer header
+#define PCAP_LINKTYPE_RAW 101
+
+/// The pcap file header, written once at the start of the output
+typedef struct PcapFileHeader_S
+{
+    uint32_t magic;                  ///< PCAP_MAGIC
+    uint16_t versionMajor;           ///< file format major version (2)
+    uint16_t versionMinor;           ///< file format minor version (4)
+    int32_t thisZone;                ///< GMT offset of the timestamps (0)
+    uint32_t sigFigs;                ///< accuracy of the timestamps (0)
+    uint32_t snapLen;                ///< maximum length of a captured packet
+    uint32_t linkType;               ///< link layer type of the packets
+} PcapFileHeader;
+
+/// The pcap record header that precedes every captured packet
+typedef struct PcapRecordHeader_S
+{
+    uint32_t tsSec;                  ///< seconds of the capture time
+    uint32_t tsUsec;                 ///< microseconds of the capture time
+    uint32_t inclLen;                ///< number of bytes saved in the file
+    uint32_t origLen;                ///< actual length of the packet
+} PcapRecordHeader;
+
+/// A single entry of the ring, one captured packet
+typedef struct TapSlot_S
+{
+    PcapRecordHeader hdr;            ///< record header, filled by producer
+    unsigned char data[TAP_SNAPLEN]; ///< captured packet bytes
+} TapSlot;
+
+/// The type used to hold the state of a tap
+typedef struct Tap_S
+{
+    _Alignas(CACHE_LINE) atomic_size_t head;   ///< next slot to fill
+    unsigned int sampleCount;                  ///< selected packets skipped
+    unsigned long numTapped;                   ///< packets put in the ring
+    unsigned long numDropped;                  ///< packets lost to full ring
+    unsigned long numUnread;                   ///< packets lost for want of
+                                               ///< a reader
+    _Alignas(CACHE_LINE) atomic_size_t tail;   ///< next slot to write out
+    atomic_bool running;                       ///< cleared to stop writer
+    TapSelect select;                          ///< which packets to mirror
+    unsigned int sampleRate;                   ///< mirror 1 in sampleRate
+    char* filename;                            ///< name of the output file
+    int fd;                                    ///< output file descriptor
+    pthread_t tid;                             ///< the writer thread
+    TapSlot slots[TAP_RING_SLOTS];             ///< the ring itself
+} Tap;
+
+
+/// Sleeps the calling thread for the given number of milliseconds.
+/// @param ms The number of milliseconds to sleep
+static void sleep_ms(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+
+/// Reads a clock that only moves forward.
+/// @return The current time in milliseconds
+static long long now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+
+/// Tries once to open the output of the tap. Opening a named pipe for
+/// writing fails until somebody reads from it, in which case the output is
+/// left closed for the writer thread to try again later.
+/// @param tap The tap whose output is to be opened
+/// @return False if the output can never be opened
+static bool open_output(Tap* tap)
+{
+    // non blocking so a stalled reader can never hang the writer thread
+    tap->fd = open(tap->filename, O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK,
+                   0644);
+    // ENXIO means a named pipe with no reader yet; anything else is fatal
+    if(tap->fd == -1 && errno != ENXIO)
+    {
+        fprintf(stderr, "fw: ERROR: failed to open tap %s: %s\n",
+                tap->filename, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+
+/// Writes a buffer to the output of the tap, waiting for the output to
+/// drain if it is full. Gives up once the tap is stopped and the output
+/// stays full, so a stalled reader cannot hang destroy_tap.
+/// @param tap The tap whose output is written
+/// @param buf The bytes to write
+/// @param len The number of bytes to write
+/// @return 0 if every byte was written, EPIPE if the reader of a named pipe
+/// went away, otherwise the errno of the failure or ETIMEDOUT for a stall
+static int write_output(Tap* tap, const void* buf, size_t len)
+{
+    const unsigned char* p = buf;
+    struct pollfd pfd = { tap->fd, POLLOUT, 0 };
+
+    while(len > 0)
+    {
+        ssize_t numWritten = write(tap->fd, p, len);
+        if(numWritten > 0)
+        {
+            p += numWritten;
+            len -= numWritten;
+            continue;
+        }
+        if(numWritten == -1 && errno != EAGAIN && errno != EINTR)
+            return errno;
+        // output is full; wait for the reader unless we are shutting down
+        if(poll(&pfd, 1, TAP_POLL_MS) == 0 && !atomic_load(&tap->running))
+            return ETIMEDOUT;
+    }
+    return 0;
+}
+
+
+/// Closes the output of the tap after a write to it failed.
+/// @param tap The tap whose output failed
+/// @param error What write_output returned
+/// @return True if the output may be opened again, which it may when the
+/// reader of a named pipe went away
+static bool close_output(Tap* tap, int error)
+{
+    close(tap->fd);
+    tap->fd = -1;
+    if(error == EPIPE)
+    {
+        printf("fw: tap reader of %s went away, waiting for another.\n",
+               tap->filename);
+        return true;
+    }
+    if(error != ETIMEDOUT)
+        fprintf(stderr, "fw: ERROR: failed to write tap %s: %s\n",
+                tap->filename, strerror(error));
+    return false;
+}
+
+
+/// Runs as a thread and writes the packets placed in the ring of a tap
+/// to its output in pcap format. While the output has no reader the ring is
+/// still emptied, and the output is opened again every TAP_POLL_MS. When
+/// the tap is stopped the ring is emptied before the thread returns.
+/// @param args pointer to the Tap
+/// @return always NULL
+static void* tap_writer_thread(void* args)
+{
+    Tap* tap = args;
+    PcapFileHeader fileHdr = { PCAP_MAGIC, 2, 4, 0, 0, TAP_SNAPLEN,
+                               PCAP_LINKTYPE_RAW };
+    // false once the output has failed for good
+    bool ok = true;
+    long long nextOpen = 0;
+    int error;
+
+    while(true)
+    {
+        // every reader of a named pipe starts with its own file header
+        if(ok && tap->fd == -1 && now_ms() >= nextOpen)
+        {
+            ok = open_output(tap);
+            nextOpen = now_ms() + TAP_POLL_MS;
+            if(tap->fd != -1 &&
+               (error = write_output(tap, &fileHdr, sizeof(fileHdr))) != 0)
+                ok = close_output(tap, error);
+        }
+
+        size_t tail = atomic_load_explicit(&tap->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&tap->head, memory_order_acquire);
+
+        if(tail == head)
+        {
+            // ring is empty, only leave once told to and nothing is left
+            if(!atomic_load(&tap->running))
+                break;
+            sleep_ms(1);
+            continue;
+        }
+
+        TapSlot* slot = &tap->slots[tail & (TAP_RING_SLOTS - 1)];
+        // without an output, just keep emptying the ring
+        if(tap->fd == -1)
+            ++tap->numUnread;
+        else if((error = write_output(tap, &slot->hdr, sizeof(slot->hdr))) != 0 ||
+                (error = write_output(tap, slot->data, slot->hdr.inclLen)) != 0)
+            ok = close_output(tap, error);
+
+        // hands the slot back to the producer
+        atomic_store_explicit(&tap->tail, tail + 1, memory_order_release);
+    }
+
+    if(tap->fd != -1)
+        close(tap->fd);
+    return NULL;
+}
+
+
+/// Creates an instance of a tap by allocating memory for a Tap, and
+/// starting its writer thread.
+/// @param filename The path/filename of the pcap output file or named pipe
+/// @param select Which packets are to be mirrored
+/// @param sampleRate Mirror 1 in every sampleRate selected packets
+/// @return A pointer to the new tap, NULL on failure
+PktTap create_tap(char* filename, TapSelect select, unsigned int sampleRate)
+{
+    Tap* tap = aligned_alloc(CACHE_LINE, sizeof(Tap));
+
+    // checks to make sure the allocation was successful
+    if(tap == NULL)
+    {
+        perror("Error creating tap");
+        return NULL;
+    }
+
+    atomic_init(&tap->head, 0);
+    atomic_init(&tap->tail, 0);
+    atomic_init(&tap->running, true);
+    tap->sampleCount = 0;
+    tap->numTapped = 0;
+    tap->numDropped = 0;
+    tap->numUnread = 0;
+    tap->select = select;
+    tap->sampleRate = sampleRate > 0 ? sampleRate : 1;
+    tap->filename = filename;
+    tap->fd = -1;
+
+    if(pthread_create(&tap->tid, NULL, tap_writer_thread, tap) != 0)
+    {
+        fprintf(stderr, "fw: ERROR: failed to start tap writer thread.\n");
+        free(tap);
+        return NULL;
+    }
+    return (PktTap) tap;
+}
+
+
+/// Destroys an instance of a tap by stopping its writer thread, which
+/// writes out all packets still in the ring, and freeing its memory.
+/// @param tap The tap that is to be destroyed
+void destroy_tap(PktTap tap)
+{
+    Tap* pTap = tap;
+
+    atomic_store(&pTap->running, false);
+    pthread_join(pTap->tid, NULL);
+    printf("fw: tap mirrored %lu packets, dropped %lu, %lu with no reader.\n",
+           pTap->numTapped, pTap->numDropped, pTap->numUnread);
+    free(pTap);
+}
+
+
+/// Decides if the packet is selected and sampled, and if so copies it into
+/// the next free slot of the ring. If the ring is full the packet is counted
+/// as dropped rather than waiting for the writer thread.
+/// @param tap The tap to use
+/// @param pkt The packet to mirror
+/// @param length The length of the packet in bytes
+/// @param allowed True if the firewall allowed the packet
+void tap_packet(PktTap tap, unsigned char* pkt, int length, bool allowed)
+{
+    Tap* pTap = tap;
+    struct timespec now;
+
+    if((pTap->select == TAP_BLOCKED && allowed) ||
+       (pTap->select == TAP_ALLOWED && !allowed))
+        return;
+
+    // only one in every sampleRate selected packets is mirrored
+    if(++pTap->sampleCount < pTap->sampleRate)
+        return;
+    pTap->sampleCount = 0;
+
+    // only the producer writes head, so a relaxed load is enough
+    size_t head = atomic_load_explicit(&pTap->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&pTap->tail, memory_order_acquire);
+    if(head - tail == TAP_RING_SLOTS)
+    {
+        ++pTap->numDropped;
+        return;
+    }
+
+    TapSlot* slot = &pTap->slots[head & (TAP_RING_SLOTS - 1)];
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->hdr.tsSec = now.tv_sec;
+    slot->hdr.tsUsec = now.tv_nsec / 1000;
+    slot->hdr.origLen = length;
+    slot->hdr.inclLen = length < TAP_SNAPLEN ? length : TAP_SNAPLEN;
+    memcpy(slot->data, pkt, slot->hdr.inclLen);
+
+    // publishes the slot to the writer thread
+    atomic_store_explicit(&pTap->head, head + 1, memory_order_release);
+    ++pTap->numTapped;
+}
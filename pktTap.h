@@ -0,0 +1,51 @@
+/// \file pktTap.h
+/// \brief Mirrors a sample of the packets seen by the firewall to a
+/// pcap formatted file or named pipe without slowing down the firewall.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __PKT_TAP_H__
+#define __PKT_TAP_H__
+
+#include <stdbool.h>
+
+/// largest number of bytes of a packet that is captured by the tap
+#define TAP_SNAPLEN 2048
+
+
+/// Type used to choose which packets are mirrored by a tap
+typedef enum TapSelect_E
+{
+    TAP_BLOCKED,                     ///< only packets the firewall blocked
+    TAP_ALLOWED,                     ///< only packets the firewall allowed
+    TAP_ALL                          ///< every packet
+} TapSelect;
+
+
+/// The type used by the client to store/use a tap instance
+typedef void* PktTap;
+
+
+/// Creates an instance of a packet tap and starts the thread that writes
+/// the captured packets to the output file.
+/// @param filename The path/filename of the pcap output file or named pipe
+/// @param select Which packets are to be mirrored
+/// @param sampleRate Mirror 1 in every sampleRate selected packets
+/// @return A pointer to the new instance, NULL on failure
+PktTap create_tap(char* filename, TapSelect select, unsigned int sampleRate);
+
+
+/// Stops the writer thread of a tap instance, writes out any packets that
+/// are still queued and frees all of the associated memory.
+/// @param tap The tap instance to destroy
+void destroy_tap(PktTap tap);
+
+
+/// Offers a packet to the tap. Never blocks; if the writer thread has fallen
+/// behind the packet is dropped from the capture instead.
+/// @param tap The tap instance to use
+/// @param pkt The IP packet that was examined by the firewall
+/// @param length The length of the packet in bytes
+/// @param allowed True if the firewall allowed the packet
+void tap_packet(PktTap tap, unsigned char* pkt, int length, bool allowed);
+
+#endif
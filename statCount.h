@@ -0,0 +1,24 @@
+/// \file statCount.h
+/// \brief Counters that one thread adds to while any thread may read them.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __STAT_COUNT_H__
+#define __STAT_COUNT_H__
+
+#include <stdatomic.h>
+
+
+/// Adds to a counter that only one thread ever writes. Readers in other
+/// threads need it to be atomic, but the one writer can use a relaxed load
+/// and store, which is no slower than a plain add and needs no locked
+/// instruction.
+/// @param counter The counter to add to
+/// @param value The amount to add
+static inline void add_count(atomic_ulong* counter, unsigned long value)
+{
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+#endif
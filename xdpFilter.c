@@ -0,0 +1,883 @@
+/// \file xdpFilter.c
+/// \brief Runs the rules of a filter as an eBPF program attached to the XDP
+/// hook of a network interface, so packets are filtered in the driver.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+///
+/// The program is assembled here instruction by instruction and loaded with
+/// the bpf system call, so nothing beyond the kernel headers is needed. It
+/// never changes once loaded; the rules live in maps that user space keeps
+/// up to date:
+///
+///     fw_blocked_ips  LPM trie, blocked addresses as /32 prefixes
+///     fw_ports        array indexed by TCP port, nonzero if blocked
+///     fw_config       array of one XdpConfig, local net, echo and mode
+///     fw_counts       per CPU array of the XdpCounter counters
+///
+/// and for each Ethernet frame it makes the same checks as filter_packet,
+/// at the same fixed offsets pktUtility uses for a 20 byte IP header:
+///
+///     not IPv4 -> pass
+///     mode allow all -> pass, mode block all -> drop
+///     shorter than the IP header -> drop
+///     src or dst in fw_blocked_ips -> drop
+///     a fragment after the first -> pass
+///     a first fragment without the whole TCP, UDP or ICMP header -> drop
+///     TCP without ports or ICMP without type -> drop
+///     if dst is local and src is not:
+///         protocol ICMP, echo blocked and type echo request -> drop
+///         protocol TCP and fw_ports[dst port] -> drop
+///     pass
+///
+/// Unlike the filter thread it keeps no table of first fragments, so a later
+/// fragment passes whether or not its first one was ever seen, and it does
+/// not search payloads, so sync_xdp_filter refuses rules with BLOCK_PAYLOAD.
+
+/// needed for syscall
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "fragTable.h"
+#include "pktUtility.h"
+#include "xdpFilter.h"
+
+/// most blocked addresses the address map holds; its entries are only
+/// allocated as they are added
+#define XDP_MAX_ADDRESSES (1U << 24)
+
+/// number of TCP ports, the size of the port map
+#define XDP_NUM_PORTS 65536
+
+/// most instructions in the program
+#define XDP_MAX_INSNS 160
+
+/// bytes of verifier log printed when the kernel refuses the program
+#define XDP_LOG_SIZE 65536
+
+/// offset of the IP header in an Ethernet frame
+#define ETH_HDR_LEN 14
+
+/// bytes of a frame up to the end of the IP header
+#define XDP_IP_LEN (ETH_HDR_LEN + 20)
+
+/// bytes of a frame up to the end of the ICMP type
+#define XDP_ICMP_LEN (XDP_IP_LEN + 1)
+
+/// bytes of a frame up to the end of the TCP destination port
+#define XDP_TCP_LEN (XDP_IP_LEN + 4)
+
+/// bytes in a UDP header, and in the ICMP header of an echo
+#define UDP_HDR_LEN 8
+
+/// bytes in a TCP header without options
+#define TCP_HDR_LEN 20
+
+/// stack offsets of the map keys the program builds
+#define KEY_IP (-8)
+#define KEY_SMALL (-12)
+#define KEY_COUNTER (-16)
+
+/// names of the counters, for print_xdp_stats
+static const char * const counterNames[NUM_XDP_COUNTERS] =
+    { "passed, not ipv4", "allowed", "blocked, block all mode",
+      "blocked, src-ip", "blocked, dst-ip", "blocked, echo-req",
+      "blocked, tcp-port", "blocked, cut short" };
+
+/// The value held by the config map. Addresses are in network byte order so
+/// the program can compare them with the packet without swapping.
+typedef struct XdpConfig_S
+{
+    uint32_t localNet;                         ///< local address, masked
+    uint32_t localMask;                        ///< the address mask
+    uint32_t blockInboundEchoReq;              ///< nonzero to block echo
+    uint32_t mode;                             ///< an XdpMode
+} XdpConfig;
+
+/// The key of the address map, the layout of struct bpf_lpm_trie_key
+typedef struct XdpIpKey_S
+{
+    uint32_t prefixLen;                        ///< bits of addr that count
+    uint32_t addr;                             ///< network byte order
+} XdpIpKey;
+
+/// Places in the program that jumps go to. The first NUM_XDP_COUNTERS are
+/// the verdicts, each of which counts itself with the counter of the same
+/// number.
+typedef enum XdpLabel_E
+{
+    LABEL_FRAG_LEN = NUM_XDP_COUNTERS,         ///< first fragment length check
+    LABEL_PROTOCOL,                            ///< picks the protocol rules
+    LABEL_TCP,                                 ///< the TCP port check
+    LABEL_COUNT,                               ///< counts the verdict
+    LABEL_EXIT,                                ///< returns the verdict
+    NUM_LABELS
+} XdpLabel;
+
+/// The type used to assemble the program
+typedef struct XdpProgram_S
+{
+    struct bpf_insn insns[XDP_MAX_INSNS];      ///< the instructions so far
+    bool isJump[XDP_MAX_INSNS];                ///< off holds a label to fix
+    unsigned int len;                          ///< instructions used
+    int labels[NUM_LABELS];                    ///< where each label is
+} XdpProgram;
+
+/// The type behind an XdpFilter
+typedef struct Xdp_S
+{
+    int ipMapFd;                               ///< blocked addresses
+    int portMapFd;                             ///< blocked TCP ports
+    int configMapFd;                           ///< local net, echo and mode
+    int countMapFd;                            ///< per CPU counters
+    int progFd;                                ///< the loaded program
+    int linkFd;                                ///< keeps it attached
+    unsigned int numCpus;                      ///< values per counter
+    pthread_mutex_t configLock;                ///< serializes config writes
+    XdpConfig config;                          ///< what the config map holds
+    unsigned int numAddrs;                     ///< addresses in the map
+    unsigned int* addrs;                       ///< sorted copy of them
+    unsigned char ports[XDP_NUM_PORTS / 8];    ///< bitmap of ports in the map
+} Xdp;
+
+
+/// Calls the bpf system call, which glibc has no wrapper for.
+/// @param cmd The command
+/// @param attr The arguments of the command
+/// @return What the command returns, -1 with errno set for error
+static long bpf(int cmd, union bpf_attr* attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+
+/// Creates a map.
+/// @param type The type of map
+/// @param keySize Bytes in a key
+/// @param valueSize Bytes in a value
+/// @param maxEntries Most entries the map holds
+/// @param flags Map flags
+/// @param name The name the map shows up under in bpftool
+/// @return The map descriptor, -1 for error
+static int create_map(enum bpf_map_type type, unsigned int keySize,
+                      unsigned int valueSize, unsigned int maxEntries,
+                      unsigned int flags, const char* name)
+{
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = keySize;
+    attr.value_size = valueSize;
+    attr.max_entries = maxEntries;
+    attr.map_flags = flags;
+    strncpy(attr.map_name, name, sizeof(attr.map_name) - 1);
+    fd = bpf(BPF_MAP_CREATE, &attr);
+    if(fd == -1)
+        fprintf(stderr, "fw: ERROR: failed to create map %s: %s\n", name,
+                strerror(errno));
+    return fd;
+}
+
+
+/// Adds or replaces an entry of a map.
+/// @param fd The map
+/// @param key The key
+/// @param value The value
+/// @return True if successful
+static bool update_elem(int fd, const void* key, const void* value)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uintptr_t)key;
+    attr.value = (uintptr_t)value;
+    attr.flags = BPF_ANY;
+    return bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+
+/// Removes an entry from a map.
+/// @param fd The map
+/// @param key The key
+/// @return True if the entry is gone, whether or not it was there
+static bool delete_elem(int fd, const void* key)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uintptr_t)key;
+    return bpf(BPF_MAP_DELETE_ELEM, &attr) == 0 || errno == ENOENT;
+}
+
+
+/// Reads an entry of a map.
+/// @param fd The map
+/// @param key The key
+/// @param value Where to store the value
+/// @return True if successful
+static bool lookup_elem(int fd, const void* key, void* value)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = fd;
+    attr.key = (uintptr_t)key;
+    attr.value = (uintptr_t)value;
+    return bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0;
+}
+
+
+/// Counts the CPUs the kernel could ever bring up, which is how many values
+/// a per CPU map hands back for each entry.
+/// @return The number of possible CPUs
+static unsigned int count_possible_cpus(void)
+{
+    FILE* pFile = fopen("/sys/devices/system/cpu/possible", "r");
+    char buf[256];
+    unsigned int highest = 0;
+
+    if(pFile == NULL)
+        return sysconf(_SC_NPROCESSORS_CONF);
+    // the file lists ranges such as 0-7 or 0,2-5; the highest one counts
+    if(fgets(buf, sizeof(buf), pFile) != NULL)
+    {
+        for(char* p = buf; *p != '\0'; )
+        {
+            char* end;
+            unsigned long cpu = strtoul(p, &end, 10);
+            if(end == p)
+                ++p;
+            else
+            {
+                if(cpu > highest)
+                    highest = cpu;
+                p = end;
+            }
+        }
+    }
+    fclose(pFile);
+    return highest + 1;
+}
+
+
+/// Appends an instruction to the program.
+/// @param prog The program
+/// @param code The opcode
+/// @param dst The destination register
+/// @param src The source register
+/// @param off The offset
+/// @param imm The immediate value
+static void emit(XdpProgram* prog, uint8_t code, uint8_t dst, uint8_t src,
+                 int16_t off, int32_t imm)
+{
+    struct bpf_insn insn = { code, dst, src, off, imm };
+
+    prog->isJump[prog->len] = false;
+    prog->insns[prog->len++] = insn;
+}
+
+
+/// Appends a jump to a label, whose offset is filled in by link_program.
+/// @param prog The program
+/// @param code The opcode
+/// @param dst The register compared
+/// @param src The register compared with for BPF_X jumps
+/// @param imm The value compared with for BPF_K jumps
+/// @param label Where to jump to, an XdpLabel or the XdpCounter of a verdict
+static void emit_jump(XdpProgram* prog, uint8_t code, uint8_t dst,
+                      uint8_t src, int32_t imm, int label)
+{
+    emit(prog, code, dst, src, label, imm);
+    prog->isJump[prog->len - 1] = true;
+}
+
+
+/// Appends the instructions that look up the key at a stack offset in a map,
+/// leaving a pointer to the value, or 0 if there is none, in r0.
+/// @param prog The program
+/// @param mapFd The map
+/// @param keyOffset Stack offset of the key
+static void emit_lookup(XdpProgram* prog, int mapFd, int keyOffset)
+{
+    // a 64 bit load that the kernel turns into the address of the map
+    emit(prog, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapFd);
+    emit(prog, 0, 0, 0, 0, 0);
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+    emit(prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, keyOffset);
+    emit(prog, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+}
+
+
+/// Marks the next instruction as the target of a label.
+/// @param prog The program
+/// @param label An XdpLabel or the XdpCounter of a verdict
+static void place_label(XdpProgram* prog, int label)
+{
+    prog->labels[label] = prog->len;
+}
+
+
+/// Fills in the offsets of the jumps once every label has been placed.
+/// Offsets count instructions from the one after the jump.
+/// @param prog The program
+static void link_program(XdpProgram* prog)
+{
+    for(unsigned int i = 0; i < prog->len; ++i)
+    {
+        if(prog->isJump[i])
+            prog->insns[i].off = prog->labels[prog->insns[i].off] - (i + 1);
+    }
+}
+
+
+/// Appends the instructions that drop a frame cut short of some length,
+/// counting it as truncated, as filter_packet blocks such a packet.
+/// @param prog The program
+/// @param length Bytes the frame needs, from the start of the Ethernet header
+static void emit_length_check(XdpProgram* prog, int32_t length)
+{
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0);
+    emit(prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, length);
+    emit_jump(prog, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_6, 0,
+              XDP_COUNT_TRUNCATED);
+}
+
+
+/// Appends the instructions that pass a frame unless its destination is on
+/// the local net and its source is not, which is when the protocol rules
+/// apply.
+/// @param prog The program
+static void emit_inbound_check(XdpProgram* prog)
+{
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_8,
+         offsetof(XdpConfig, localMask), 0);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_3, BPF_REG_8,
+         offsetof(XdpConfig, localNet), 0);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7,
+         ETH_HDR_LEN + 16, 0);
+    emit(prog, BPF_ALU64 | BPF_AND | BPF_X, BPF_REG_1, BPF_REG_2, 0, 0);
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_X, BPF_REG_1, BPF_REG_3, 0,
+              XDP_COUNT_ALLOWED);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7,
+         ETH_HDR_LEN + 12, 0);
+    emit(prog, BPF_ALU64 | BPF_AND | BPF_X, BPF_REG_1, BPF_REG_2, 0, 0);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_X, BPF_REG_1, BPF_REG_3, 0,
+              XDP_COUNT_ALLOWED);
+}
+
+
+/// Assembles the program. Registers that survive helper calls hold what
+/// is used throughout: r6 the end of the frame until it is the verdict, r7
+/// the frame, r8 the config and r9 the counter to add one to. Each field is
+/// only read once the frame is known to be long enough for it, and a frame
+/// cut short meets the mode and address checks first, as in filter_packet.
+/// @param prog Where to assemble it
+/// @param xdp The maps it uses
+static void generate(XdpProgram* prog, const Xdp* xdp)
+{
+    prog->len = 0;
+
+    // makes sure the frame holds the Ethernet header
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_7, BPF_REG_1,
+         offsetof(struct xdp_md, data), 0);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_6, BPF_REG_1,
+         offsetof(struct xdp_md, data_end), 0);
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0);
+    emit(prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, ETH_HDR_LEN);
+    emit_jump(prog, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_6, 0,
+              XDP_COUNT_NOT_IPV4);
+    // the ethertype, still in network byte order
+    emit(prog, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_2, BPF_REG_7, 12, 0);
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, htons(ETH_P_IP),
+              XDP_COUNT_NOT_IPV4);
+
+    // the mode decides before any rule is looked at
+    emit(prog, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, KEY_SMALL, 0);
+    emit_lookup(prog, xdp->configMapFd, KEY_SMALL);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0,
+              XDP_COUNT_ALLOWED);
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_8, BPF_REG_0, 0, 0);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_8,
+         offsetof(XdpConfig, mode), 0);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0,
+              XDP_MODE_ALLOW_ALL, XDP_COUNT_ALLOWED);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0,
+              XDP_MODE_BLOCK_ALL, XDP_COUNT_BLOCK_ALL);
+
+    // the rules read nothing from a frame without a whole IP header
+    emit_length_check(prog, XDP_IP_LEN);
+
+    // the source and then the destination address as full length prefixes
+    emit(prog, BPF_ST | BPF_W | BPF_MEM, BPF_REG_10, 0, KEY_IP, 32);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7,
+         ETH_HDR_LEN + 12, 0);
+    emit(prog, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_1, KEY_IP + 4, 0);
+    emit_lookup(prog, xdp->ipMapFd, KEY_IP);
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0,
+              XDP_COUNT_SRC_IP);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_7,
+         ETH_HDR_LEN + 16, 0);
+    emit(prog, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_1, KEY_IP + 4, 0);
+    emit_lookup(prog, xdp->ipMapFd, KEY_IP);
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 0,
+              XDP_COUNT_DST_IP);
+
+    // a later fragment has no header for the protocol rules to read, and
+    // with no table of first fragments here it is passed untracked; when its
+    // first fragment was dropped, the datagram never reassembles
+    emit(prog, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_1, BPF_REG_7,
+         ETH_HDR_LEN + 6, 0);
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1, 0, 0);
+    emit(prog, BPF_ALU | BPF_AND | BPF_K, BPF_REG_2, 0, 0, htons(IP_FRAG_OFFSET));
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_2, 0, 0,
+              XDP_COUNT_ALLOWED);
+    emit(prog, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_3, BPF_REG_7,
+         ETH_HDR_LEN + 9, 0);
+
+    // a first fragment has to hold the whole TCP, UDP or ICMP header, as in
+    // frag_table_first (RFC 1858)
+    emit(prog, BPF_ALU | BPF_AND | BPF_K, BPF_REG_1, 0, 0, htons(IP_FRAG_MORE));
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0, 0, LABEL_PROTOCOL);
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_7, 0, 0);
+    emit(prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0,
+         XDP_IP_LEN + UDP_HDR_LEN);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0,
+              IP_PROTOCOL_UDP, LABEL_FRAG_LEN);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0,
+              IP_PROTOCOL_ICMP, LABEL_FRAG_LEN);
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_3, 0,
+              IP_PROTOCOL_TCP, LABEL_PROTOCOL);
+    emit(prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0,
+         TCP_HDR_LEN - UDP_HDR_LEN);
+    place_label(prog, LABEL_FRAG_LEN);
+    emit_jump(prog, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_2, BPF_REG_6, 0,
+              XDP_COUNT_TRUNCATED);
+
+    // only ICMP and TCP have protocol rules, each of which first makes sure
+    // the frame holds the field it reads
+    place_label(prog, LABEL_PROTOCOL);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_3, 0,
+              IP_PROTOCOL_TCP, LABEL_TCP);
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_3, 0,
+              IP_PROTOCOL_ICMP, XDP_COUNT_ALLOWED);
+
+    emit_length_check(prog, XDP_ICMP_LEN);
+    emit_inbound_check(prog);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_2, BPF_REG_8,
+         offsetof(XdpConfig, blockInboundEchoReq), 0);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0, 0,
+              XDP_COUNT_ALLOWED);
+    emit(prog, BPF_LDX | BPF_B | BPF_MEM, BPF_REG_1, BPF_REG_7,
+         ETH_HDR_LEN + 20, 0);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_1, 0,
+              ICMP_TYPE_ECHO_REQ, XDP_COUNT_ECHO_REQ);
+    emit_jump(prog, BPF_JMP | BPF_JA, 0, 0, 0, XDP_COUNT_ALLOWED);
+
+    place_label(prog, LABEL_TCP);
+    emit_length_check(prog, XDP_TCP_LEN);
+    emit_inbound_check(prog);
+    emit(prog, BPF_LDX | BPF_H | BPF_MEM, BPF_REG_1, BPF_REG_7,
+         ETH_HDR_LEN + 22, 0);
+    emit(prog, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_1, 0, 0, 16);
+    emit(prog, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_1, KEY_SMALL, 0);
+    emit_lookup(prog, xdp->portMapFd, KEY_SMALL);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0,
+              XDP_COUNT_ALLOWED);
+    emit(prog, BPF_LDX | BPF_W | BPF_MEM, BPF_REG_1, BPF_REG_0, 0, 0);
+    emit_jump(prog, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_1, 0, 0,
+              XDP_COUNT_TCP_PORT);
+    emit_jump(prog, BPF_JMP | BPF_JA, 0, 0, 0, XDP_COUNT_ALLOWED);
+
+    // each verdict sets what to return and which counter to add one to
+    for(int counter = 0; counter < NUM_XDP_COUNTERS; ++counter)
+    {
+        bool pass = counter == XDP_COUNT_NOT_IPV4 || counter == XDP_COUNT_ALLOWED;
+
+        place_label(prog, counter);
+        emit(prog, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_6, 0, 0,
+             pass ? XDP_PASS : XDP_DROP);
+        emit(prog, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_9, 0, 0, counter);
+        emit_jump(prog, BPF_JMP | BPF_JA, 0, 0, 0, LABEL_COUNT);
+    }
+
+    // each CPU has its own counters, so a plain add is safe
+    place_label(prog, LABEL_COUNT);
+    emit(prog, BPF_STX | BPF_W | BPF_MEM, BPF_REG_10, BPF_REG_9, KEY_COUNTER, 0);
+    emit_lookup(prog, xdp->countMapFd, KEY_COUNTER);
+    emit_jump(prog, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 0, LABEL_EXIT);
+    emit(prog, BPF_LDX | BPF_DW | BPF_MEM, BPF_REG_1, BPF_REG_0, 0, 0);
+    emit(prog, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1);
+    emit(prog, BPF_STX | BPF_DW | BPF_MEM, BPF_REG_0, BPF_REG_1, 0, 0);
+
+    place_label(prog, LABEL_EXIT);
+    emit(prog, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_0, BPF_REG_6, 0, 0);
+    emit(prog, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+    link_program(prog);
+}
+
+
+/// Loads the program into the kernel. If the verifier turns it down the
+/// load is repeated with logging on so the reason can be printed.
+/// @param prog The assembled program
+/// @return The program descriptor, -1 for error
+static int load_program(const XdpProgram* prog)
+{
+    union bpf_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = prog->len;
+    attr.insns = (uintptr_t)prog->insns;
+    attr.license = (uintptr_t)"GPL";
+    strncpy(attr.prog_name, "fw_filter", sizeof(attr.prog_name) - 1);
+    fd = bpf(BPF_PROG_LOAD, &attr);
+    if(fd != -1)
+        return fd;
+
+    fprintf(stderr, "fw: ERROR: failed to load xdp program: %s\n",
+            strerror(errno));
+    char* log = malloc(XDP_LOG_SIZE);
+    if(log != NULL)
+    {
+        log[0] = '\0';
+        attr.log_level = 1;
+        attr.log_size = XDP_LOG_SIZE;
+        attr.log_buf = (uintptr_t)log;
+        if(bpf(BPF_PROG_LOAD, &attr) == -1)
+            fputs(log, stderr);
+        free(log);
+    }
+    return -1;
+}
+
+
+/// Attaches a loaded program to the XDP hook of an interface with a link,
+/// which detaches it again when the link is closed.
+/// @param progFd The program
+/// @param ifname The interface
+/// @return The link descriptor, -1 for error
+static int attach_program(int progFd, const char* ifname)
+{
+    union bpf_attr attr;
+    unsigned int ifindex = if_nametoindex(ifname);
+    int fd;
+
+    if(ifindex == 0)
+    {
+        fprintf(stderr, "fw: ERROR: no interface %s.\n", ifname);
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = progFd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    fd = bpf(BPF_LINK_CREATE, &attr);
+    if(fd == -1)
+        fprintf(stderr, "fw: ERROR: failed to attach xdp program to %s: %s\n",
+                ifname, strerror(errno));
+    return fd;
+}
+
+
+/// Writes the config map from the copy kept in the instance.
+/// @param pXdp The instance
+/// @return True if successful
+/// @pre caller holds the configLock of the instance
+static bool write_config(Xdp* pXdp)
+{
+    uint32_t key = 0;
+    return update_elem(pXdp->configMapFd, &key, &pXdp->config);
+}
+
+
+/// Creates an XDP filter by creating its maps, assembling and loading the
+/// program and attaching it to the interface.
+/// @param ifname The name of the interface
+/// @return A pointer to the new instance, NULL if something failed
+XdpFilter create_xdp_filter(const char* ifname)
+{
+    Xdp* pXdp = malloc(sizeof(Xdp));
+    XdpProgram* prog = malloc(sizeof(XdpProgram));
+
+    if(pXdp == NULL || prog == NULL)
+    {
+        perror("Error creating xdp filter");
+        free(pXdp);
+        free(prog);
+        return NULL;
+    }
+
+    pXdp->progFd = -1;
+    pXdp->linkFd = -1;
+    pXdp->numCpus = count_possible_cpus();
+    pthread_mutex_init(&pXdp->configLock, NULL);
+    pXdp->numAddrs = 0;
+    pXdp->addrs = NULL;
+    memset(pXdp->ports, 0, sizeof(pXdp->ports));
+    // an empty filter in filter mode until the first sync
+    memset(&pXdp->config, 0, sizeof(pXdp->config));
+    pXdp->config.mode = XDP_MODE_FILTER;
+
+    // lpm tries have to allocate entries as they are added
+    pXdp->ipMapFd = create_map(BPF_MAP_TYPE_LPM_TRIE, sizeof(XdpIpKey),
+                               sizeof(uint32_t), XDP_MAX_ADDRESSES,
+                               BPF_F_NO_PREALLOC, "fw_blocked_ips");
+    pXdp->portMapFd = create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                                 sizeof(uint32_t), XDP_NUM_PORTS, 0, "fw_ports");
+    pXdp->configMapFd = create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+                                   sizeof(XdpConfig), 1, 0, "fw_config");
+    pXdp->countMapFd = create_map(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t),
+                                  sizeof(uint64_t), NUM_XDP_COUNTERS, 0,
+                                  "fw_counts");
+    if(pXdp->ipMapFd != -1 && pXdp->portMapFd != -1 &&
+       pXdp->configMapFd != -1 && pXdp->countMapFd != -1 &&
+       write_config(pXdp))
+    {
+        generate(prog, pXdp);
+        pXdp->progFd = load_program(prog);
+        if(pXdp->progFd != -1)
+            pXdp->linkFd = attach_program(pXdp->progFd, ifname);
+    }
+    free(prog);
+
+    if(pXdp->linkFd == -1)
+    {
+        destroy_xdp_filter(pXdp);
+        return NULL;
+    }
+    return (XdpFilter) pXdp;
+}
+
+
+/// Destroys an XDP filter. Closing the link detaches the program, and the
+/// kernel frees the program and maps once nothing refers to them.
+/// @param xdp The instance that is to be destroyed
+void destroy_xdp_filter(XdpFilter xdp)
+{
+    Xdp* pXdp = xdp;
+    int fds[] = { pXdp->linkFd, pXdp->progFd, pXdp->ipMapFd, pXdp->portMapFd,
+                  pXdp->configMapFd, pXdp->countMapFd };
+
+    for(size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i)
+    {
+        if(fds[i] != -1)
+            close(fds[i]);
+    }
+    pthread_mutex_destroy(&pXdp->configLock);
+    free(pXdp->addrs);
+    free(pXdp);
+}
+
+
+/// Brings the local net and echo settings of the config map up to date.
+/// @param pXdp The instance
+/// @param rules The rules of the filter
+/// @return True if successful
+static bool sync_config(Xdp* pXdp, const FilterRules* rules)
+{
+    bool synced;
+
+    pthread_mutex_lock(&pXdp->configLock);
+    pXdp->config.localNet = htonl(rules->localIpAddr & rules->localMask);
+    pXdp->config.localMask = htonl(rules->localMask);
+    pXdp->config.blockInboundEchoReq = rules->blockInboundEchoReq;
+    synced = write_config(pXdp);
+    pthread_mutex_unlock(&pXdp->configLock);
+    return synced;
+}
+
+
+/// Brings the port map up to date, writing only the ports that changed.
+/// @param pXdp The instance
+/// @param rules The rules of the filter
+/// @return True if successful
+static bool sync_ports(Xdp* pXdp, const FilterRules* rules)
+{
+    unsigned char wanted[XDP_NUM_PORTS / 8];
+
+    memset(wanted, 0, sizeof(wanted));
+    for(unsigned int i = 0; i < rules->numBlockedInboundTcpPorts; ++i)
+    {
+        unsigned int port = rules->blockedInboundTcpPorts[i];
+        if(port < XDP_NUM_PORTS)
+            wanted[port / 8] |= 1 << port % 8;
+    }
+
+    for(uint32_t port = 0; port < XDP_NUM_PORTS; ++port)
+    {
+        unsigned char bit = 1 << port % 8;
+        uint32_t blocked = (wanted[port / 8] & bit) != 0;
+
+        if(blocked == ((pXdp->ports[port / 8] & bit) != 0))
+            continue;
+        if(!update_elem(pXdp->portMapFd, &port, &blocked))
+            return false;
+        pXdp->ports[port / 8] ^= bit;
+    }
+    return true;
+}
+
+
+/// Brings the address map up to date. Both the addresses in the map and
+/// those of the filter are sorted, so one merge of the two finds the ones
+/// to delete and the ones to add.
+/// @param pXdp The instance
+/// @param rules The rules of the filter
+/// @return True if successful
+static bool sync_addresses(Xdp* pXdp, const FilterRules* rules)
+{
+    unsigned int* inMap = malloc(sizeof(unsigned int) *
+                                 (pXdp->numAddrs + rules->numBlockedIpAddresses) + 1);
+    unsigned int numInMap = 0, i = 0, j = 0;
+    bool synced = true;
+
+    if(inMap == NULL)
+    {
+        perror("Error syncing xdp filter");
+        return false;
+    }
+
+    // inMap ends up holding what the map really holds, even after a failure
+    while(i < pXdp->numAddrs || j < rules->numBlockedIpAddresses)
+    {
+        XdpIpKey key = { 32, 0 };
+
+        if(j == rules->numBlockedIpAddresses ||
+           (i < pXdp->numAddrs && pXdp->addrs[i] < rules->blockedIpAddresses[j]))
+        {
+            key.addr = htonl(pXdp->addrs[i]);
+            if(!delete_elem(pXdp->ipMapFd, &key))
+            {
+                inMap[numInMap++] = pXdp->addrs[i];
+                synced = false;
+            }
+            ++i;
+        }
+        else if(i == pXdp->numAddrs ||
+                rules->blockedIpAddresses[j] < pXdp->addrs[i])
+        {
+            uint32_t value = 1;
+
+            key.addr = htonl(rules->blockedIpAddresses[j]);
+            if(update_elem(pXdp->ipMapFd, &key, &value))
+                inMap[numInMap++] = rules->blockedIpAddresses[j];
+            else
+                synced = false;
+            ++j;
+        }
+        else
+        {
+            inMap[numInMap++] = pXdp->addrs[i];
+            ++i;
+            ++j;
+        }
+    }
+
+    free(pXdp->addrs);
+    pXdp->addrs = inMap;
+    pXdp->numAddrs = numInMap;
+    return synced;
+}
+
+
+/// Brings the maps up to date with the rules of a filter, unless it has
+/// payload rules, which the program can't apply.
+/// @param xdp The instance to update
+/// @param filter The filter whose rules are copied
+/// @return True if the maps hold the rules of the filter
+bool sync_xdp_filter(XdpFilter xdp, IpPktFilter filter)
+{
+    Xdp* pXdp = xdp;
+    FilterRules* rules = copy_filter_rules(filter);
+    bool synced;
+
+    if(rules == NULL)
+        return false;
+    // letting through what the filter thread would block is no way to filter
+    if(rules->numBlockedPayloads > 0)
+    {
+        fprintf(stderr, "fw: ERROR: xdp does not inspect payloads, run without "
+                "-x to apply the %u BLOCK_PAYLOAD rules\n",
+                rules->numBlockedPayloads);
+        destroy_filter_rules(rules);
+        return false;
+    }
+    synced = sync_config(pXdp, rules) && sync_ports(pXdp, rules) &&
+             sync_addresses(pXdp, rules);
+    if(!synced)
+        fprintf(stderr, "fw: ERROR: failed to update xdp maps: %s\n",
+                strerror(errno));
+    destroy_filter_rules(rules);
+    return synced;
+}
+
+
+/// Sets the mode the XDP program uses.
+/// @param xdp The instance to update
+/// @param mode The new mode
+/// @return True if successful
+bool set_xdp_mode(XdpFilter xdp, XdpMode mode)
+{
+    Xdp* pXdp = xdp;
+    bool set;
+
+    pthread_mutex_lock(&pXdp->configLock);
+    pXdp->config.mode = mode;
+    set = write_config(pXdp);
+    pthread_mutex_unlock(&pXdp->configLock);
+    return set;
+}
+
+
+/// Reads the counters, adding up the values every CPU has for each one.
+/// @param xdp The instance to read
+/// @param counts Where to store the counts
+/// @return True if successful
+bool read_xdp_counters(XdpFilter xdp, unsigned long counts[NUM_XDP_COUNTERS])
+{
+    Xdp* pXdp = xdp;
+    uint64_t* values = malloc(sizeof(uint64_t) * pXdp->numCpus);
+    bool read = values != NULL;
+
+    for(uint32_t counter = 0; read && counter < NUM_XDP_COUNTERS; ++counter)
+    {
+        read = lookup_elem(pXdp->countMapFd, &counter, values);
+        counts[counter] = 0;
+        for(unsigned int cpu = 0; read && cpu < pXdp->numCpus; ++cpu)
+            counts[counter] += values[cpu];
+    }
+    free(values);
+    return read;
+}
+
+
+/// Prints the counters of the XDP program.
+/// @param xdp The instance to describe
+/// @param out The stream to print to
+void print_xdp_stats(XdpFilter xdp, FILE* out)
+{
+    unsigned long counts[NUM_XDP_COUNTERS];
+
+    if(!read_xdp_counters(xdp, counts))
+    {
+        fprintf(out, "xdp counters unavailable: %s\n", strerror(errno));
+        return;
+    }
+    for(int counter = 0; counter < NUM_XDP_COUNTERS; ++counter)
+        fprintf(out, "xdp %s: %lu\n", counterNames[counter], counts[counter]);
+}
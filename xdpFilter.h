@@ -0,0 +1,86 @@
+/// \file xdpFilter.h
+/// \brief Runs the rules of a filter as an eBPF program attached to the XDP
+/// hook of a network interface, so packets are filtered in the driver.
+/// Author: kjb2503 : Kevin Becker (RIT Student)
+
+#ifndef __XDP_FILTER_H__
+#define __XDP_FILTER_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "filter.h"
+
+
+/// What the XDP program does with IPv4 packets, the same choices as the
+/// modes of the firewall
+typedef enum XdpMode_E
+{
+    XDP_MODE_BLOCK_ALL,                        ///< drop every packet
+    XDP_MODE_ALLOW_ALL,                        ///< pass every packet
+    XDP_MODE_FILTER                            ///< apply the filter rules
+} XdpMode;
+
+
+/// The outcomes the XDP program counts, one counter each
+typedef enum XdpCounter_E
+{
+    XDP_COUNT_NOT_IPV4,                        ///< passed, not an IPv4 packet
+    XDP_COUNT_ALLOWED,                         ///< passed by mode or rules
+    XDP_COUNT_BLOCK_ALL,                       ///< dropped by block all mode
+    XDP_COUNT_SRC_IP,                          ///< dropped, blocked source
+    XDP_COUNT_DST_IP,                          ///< dropped, blocked destination
+    XDP_COUNT_ECHO_REQ,                        ///< dropped, inbound echo request
+    XDP_COUNT_TCP_PORT,                        ///< dropped, inbound blocked port
+    XDP_COUNT_TRUNCATED,                       ///< dropped, cut short of the
+                                               ///< headers the rules read
+    NUM_XDP_COUNTERS
+} XdpCounter;
+
+
+/// The type used by the client to store/use an XDP filter instance
+typedef void* XdpFilter;
+
+
+/// Loads the XDP program and its maps and attaches it to an interface. The
+/// maps start out empty in filter mode; call sync_xdp_filter to fill them.
+/// The program stays attached until the instance is destroyed.
+/// @param ifname The name of the interface, e.g. eth0 or a veth
+/// @return A pointer to the new instance, NULL if the kernel refused
+XdpFilter create_xdp_filter(const char* ifname);
+
+
+/// Detaches the XDP program and frees the maps and the instance.
+/// @param xdp The instance to destroy
+void destroy_xdp_filter(XdpFilter xdp);
+
+
+/// Brings the maps of the XDP program up to date with the rules a filter
+/// instance is using right now. Only the entries that changed since the last
+/// call are written. Only one thread at a time may sync an instance. Rules
+/// with BLOCK_PAYLOAD patterns are refused and the maps are left as they were.
+/// @param xdp The instance to update
+/// @param filter The filter instance whose rules are copied
+/// @return True if the maps hold the rules of the filter
+bool sync_xdp_filter(XdpFilter xdp, IpPktFilter filter);
+
+
+/// Sets what the XDP program does with IPv4 packets.
+/// @param xdp The instance to update
+/// @param mode The new mode
+/// @return True if successful
+bool set_xdp_mode(XdpFilter xdp, XdpMode mode);
+
+
+/// Reads the counters of the XDP program, summed over every CPU.
+/// @param xdp The instance to read
+/// @param counts Where to store the NUM_XDP_COUNTERS counts
+/// @return True if successful
+bool read_xdp_counters(XdpFilter xdp, unsigned long counts[NUM_XDP_COUNTERS]);
+
+
+/// Prints the counters of the XDP program, one line each.
+/// @param xdp The instance to describe
+/// @param out The stream to print to
+void print_xdp_stats(XdpFilter xdp, FILE* out);
+
+#endif